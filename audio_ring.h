@@ -0,0 +1,116 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __AUDIO_RING_H__
+#define __AUDIO_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Single producer / single consumer ring of packed 32 bit (delay << 16 | sample) audio events.
+ * The producer only writes head and the consumer only writes tail, so no lock is needed: a slot is
+ * published with a release store of head and freed with a release store of tail.
+ * Size must be a power of 2. Indices run freely and are masked on access, so all size entries can be used.
+ */
+typedef struct
+{
+    uint32_t *buf;
+    uint32_t mask;
+    uint32_t head;          /* Next slot to write. Only written by the producer */
+    uint32_t tail;          /* Next slot to read. Only written by the consumer */
+} audio_ring_t;
+
+static inline void audio_ring_init(audio_ring_t *r, uint32_t *buf, uint32_t size)
+{
+    r->buf = buf;
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+/* Number of events waiting. Exact for the consumer, a lower bound for the producer */
+static inline uint32_t audio_ring_count(const audio_ring_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Producer: add up to count events, returns the number added */
+static inline uint32_t audio_ring_push_batch(audio_ring_t *r, const uint32_t *values, uint32_t count)
+{
+    uint32_t head = r->head;
+    uint32_t space = r->mask + 1 - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    if (count > space)
+    {
+        count = space;
+    }
+    for (uint32_t i = 0 ; i < count ; i++)
+    {
+        r->buf[(head + i) & r->mask] = values[i];
+    }
+    __atomic_store_n(&r->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+static inline bool audio_ring_push(audio_ring_t *r, uint32_t value)
+{
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+    {
+        return false;
+    }
+    r->buf[head & r->mask] = value;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Consumer: remove up to count events, returns the number removed */
+static inline uint32_t audio_ring_pop_batch(audio_ring_t *r, uint32_t *values, uint32_t count)
+{
+    uint32_t tail = r->tail;
+    uint32_t available = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    if (count > available)
+    {
+        count = available;
+    }
+    for (uint32_t i = 0 ; i < count ; i++)
+    {
+        values[i] = r->buf[(tail + i) & r->mask];
+    }
+    __atomic_store_n(&r->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+static inline bool audio_ring_pop(audio_ring_t *r, uint32_t *value)
+{
+    uint32_t tail = r->tail;
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+    {
+        return false;
+    }
+    *value = r->buf[tail & r->mask];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
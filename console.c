@@ -0,0 +1,245 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "console.h"
+#include "joy_profile.h"
+#include "usb_joystick.h"
+#include "usb_kbd.h"
+
+/*
+ * Console on the debug serial port, for the joystick settings and profiles and the keyboard settings.
+ * Commands are read a line at a time and run from the main loop.
+ */
+#define CONSOLE_LINE_LEN    64
+#define CONSOLE_MAX_ARGS    8
+
+/* Print the settings of a connected pad */
+static void console_print_joystick(const usb_joystick *joy)
+{
+    if (joy->joynum >= 0)
+        printf("Joystick %d: ", joy->joynum + 1);
+    else
+        printf("Not bound: ");
+    printf("%04x:%04x, %d buttons, map %d %d %d %d, dead zone %d, curve %d, d-pad %s, "
+           "hysteresis %d, vsync %s, %s\n",
+           joy->vid, joy->pid, joy->def.nr_hid_buttons,
+           joy->button_map[0] + 1, joy->button_map[1] + 1, joy->button_map[2] + 1, joy->button_map[3] + 1,
+           joy->dead_zone, joy->curve, joy->merge_dpad ? "on" : "off",
+           joy->hysteresis, joy->frame_sync ? "on" : "off",
+           joy_profile_find(joy->vid, joy->pid, joy->desc_hash) ? "saved" : "not saved");
+    printf("  X: %d bits, cal %ld %ld %ld\n", joy->def.x.bits,
+           (long) joy->axis_x.min, (long) joy->axis_x.center, (long) joy->axis_x.max);
+    printf("  Y: %d bits, cal %ld %ld %ld\n", joy->def.y.bits,
+           (long) joy->axis_y.min, (long) joy->axis_y.center, (long) joy->axis_y.max);
+}
+
+static void console_help(void)
+{
+    printf("joy                           show connected pads\n"
+           "bind <n> <pad>                use pad for joystick n, 0 for none\n"
+           "profiles                      show stored profiles\n"
+           "map <n> <b1> <b2> <b3> <b4>   use controller buttons b1 - b4 for buttons 1 - 4\n"
+           "deadzone <n> <0-126>          set the dead zone\n"
+           "curve <n> <0-255>             set the response curve, from linear to cubic\n"
+           "dpad <n> <0|1>                add the hat switch / D-pad to X/Y\n"
+           "hyst <n> <0-63>               ignore X/Y changes of this size or less\n"
+           "vsync <n> <0|1>               send X/Y changes at most once per frame\n"
+           "cal <n> <x|y> <min> <centre> <max>\n"
+           "                              set the calibration of an axis\n"
+           "save <n>                      save the settings of joystick n\n"
+           "delete <n>                    delete the profile of joystick n\n"
+           "erase                         delete all profiles\n"
+           "repeat <delay> <interval>     set the keyboard repeat in ms, a delay of 0 turns it off\n"
+           "layout <us|uk|de>             set the keyboard layout, until the Pico restarts\n");
+}
+
+/* Run a console command */
+static void console_command(char *line)
+{
+    char *argv[CONSOLE_MAX_ARGS];
+    int argc = 0;
+
+    for (char *tok = strtok(line, " \t") ; tok != NULL && argc < CONSOLE_MAX_ARGS ; tok = strtok(NULL, " \t"))
+        argv[argc++] = tok;
+    if (argc == 0)
+        return;
+
+    const char *cmd = argv[0];
+    if (!strcmp(cmd, "joy"))
+    {
+        for (int pad = 0 ; pad < CFG_TUH_HID ; pad++)
+        {
+            const usb_joystick *joy = joy_get_pad(pad);
+            if (joy != NULL)
+            {
+                printf("Pad %d, ", pad + 1);
+                console_print_joystick(joy);
+            }
+        }
+        return;
+    }
+    if (!strcmp(cmd, "profiles"))
+    {
+        const joy_profile_t *profile;
+        for (int slot = 0 ; joy_profile_get(slot, &profile) ; slot++)
+        {
+            if (profile != NULL)
+            {
+                printf("%2d: %04x:%04x descriptor %08lx, map %d %d %d %d, dead zone %d, curve %d\n", slot,
+                       profile->vid, profile->pid, (unsigned long) profile->desc_hash,
+                       profile->button_map[0] + 1, profile->button_map[1] + 1, profile->button_map[2] + 1,
+                       profile->button_map[3] + 1, profile->dead_zone, profile->curve);
+            }
+        }
+        return;
+    }
+    if (!strcmp(cmd, "bind") && argc == 3)
+    {
+        if (!joy_bind(atoi(argv[1]) - 1, atoi(argv[2]) - 1))
+            printf("Can't bind pad %s to joystick %s\n", argv[2], argv[1]);
+        return;
+    }
+    if (!strcmp(cmd, "repeat") && argc == 3)
+    {
+        int delay = MIN(5000, MAX(0, atoi(argv[1])));
+        int interval = MIN(1000, MAX(1, atoi(argv[2])));
+        kbd_set_repeat(delay, interval);
+        printf("Keyboard repeat delay %d ms, interval %d ms\n", delay, interval);
+        return;
+    }
+    if (!strcmp(cmd, "layout") && argc == 2)
+    {
+        printf(kbd_set_layout(argv[1]) ? "Keyboard layout %s\n" : "No keyboard layout %s\n", argv[1]);
+        return;
+    }
+    if (!strcmp(cmd, "erase"))
+    {
+        joy_profile_erase_all();
+        printf("Profiles erased\n");
+        return;
+    }
+
+    /* The remaining commands are for a connected joystick */
+    int joynum = (argc > 1) ? atoi(argv[1]) - 1 : -1;
+    usb_joystick *joy = joy_get(joynum);
+    if (joy == NULL)
+    {
+        if (argc > 1)
+            printf("Joystick %s is not connected\n", argv[1]);
+        else
+            console_help();
+        return;
+    }
+
+    if (!strcmp(cmd, "map") && argc == 6)
+    {
+        for (int b = 0 ; b < 4 ; b++)
+            joy->button_map[b] = atoi(argv[2 + b]) - 1;
+    }
+    else if (!strcmp(cmd, "deadzone") && argc == 3)
+    {
+        joy->dead_zone = MIN(126, MAX(0, atoi(argv[2])));
+    }
+    else if (!strcmp(cmd, "curve") && argc == 3)
+    {
+        joy->curve = MIN(255, MAX(0, atoi(argv[2])));
+    }
+    else if (!strcmp(cmd, "dpad") && argc == 3)
+    {
+        joy->merge_dpad = atoi(argv[2]) != 0;
+    }
+    else if (!strcmp(cmd, "hyst") && argc == 3)
+    {
+        joy->hysteresis = MIN(63, MAX(0, atoi(argv[2])));
+    }
+    else if (!strcmp(cmd, "vsync") && argc == 3)
+    {
+        joy->frame_sync = atoi(argv[2]) != 0;
+    }
+    else if (!strcmp(cmd, "cal") && argc == 6 && (argv[2][0] == 'x' || argv[2][0] == 'y'))
+    {
+        joy_axis_t *axis = (argv[2][0] == 'x') ? &joy->axis_x : &joy->axis_y;
+        axis->min = strtol(argv[3], NULL, 0);
+        axis->center = strtol(argv[4], NULL, 0);
+        axis->max = strtol(argv[5], NULL, 0);
+    }
+    else if (!strcmp(cmd, "save") && argc == 2)
+    {
+        printf(joy_save_profile(joy) ? "Saved\n" : "Save failed\n");
+        return;
+    }
+    else if (!strcmp(cmd, "delete") && argc == 2)
+    {
+        printf(joy_profile_delete(joy->vid, joy->pid, joy->desc_hash) ? "Deleted\n" : "No profile\n");
+        return;
+    }
+    else
+    {
+        console_help();
+        return;
+    }
+
+    /* Settings take effect now, and are kept once saved */
+    joy_apply_settings(joy);
+    console_print_joystick(joy);
+}
+
+/*
+ * Read console commands from the debug serial port, without waiting for input.
+ * Called from the main loop.
+ */
+void console_task(void)
+{
+    static char line[CONSOLE_LINE_LEN];
+    static int len = 0;
+    int c;
+
+    while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT)
+    {
+        if (c == '\r' || c == '\n')
+        {
+            putchar('\n');
+            line[len] = '\0';
+            len = 0;
+            console_command(line);
+        }
+        else if (c == '\b' || c == 0x7f)
+        {
+            if (len > 0)
+            {
+                len--;
+                printf("\b \b");
+            }
+        }
+        else if (len < CONSOLE_LINE_LEN - 1)
+        {
+            line[len++] = c;
+            putchar(c);
+        }
+    }
+}
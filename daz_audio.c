@@ -23,8 +23,9 @@
  */
 
 /* The PICO I2S sound library uses DMA for transferring samples from a "producer" buffer of PCM samples to the I2S PIO program. 
- * While technically we could create output in that format, it is much more complicated. Instead we use a timer to directly 
- * write the audio values to the PIO's OSR queue.
+ * While technically we could use that library, it is much more complicated than we need. Instead we render blocks of PCM
+ * frames from the queued audio samples and DMA them directly to the PIO's TX FIFO. Two blocks are used, so one block is 
+ * rendered while the other is playing.
  * The Altair-Duino sends audio in "delay", "sample" format, where delay means how long to play the *previous* sample (in us).
 */
 #include <stdio.h>
@@ -39,31 +40,114 @@
 #include "audio_i2s.pio.h"
 #include "pico/binary_info.h"
 #include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
 
+#include "daz_audio.h"
+#include "daz_audio_render.h"
+#include "audio_ring.h"
+#include "stats.h"
 
 #define DEBUG_INFO  DEBUG_AUDIO
 #define DEBUG_TRACE TRACE_AUDIO
 #include "debug.h"
 
-#define AUDIO_QUEUE_LEN     512         /* Keep a buffer of 512 samples. This seems to be enough to minimise overflows 
-                                           without delaying audio too much */
-#define HWALARM_NUM         2           /* Dedicated hardware alarm to use */
-#define AUDIO_SAMPLE_RATE   48000       /* 48kHz audio */
-#define ALARM_FREQ          (1000000 / AUDIO_SAMPLE_RATE)   /* 20us for 48kHz, which is slightly fast, but works */
+#define AUDIO_QUEUE_LEN     1024        /* Most samples that can be buffered. The jitter buffer decides how much of this
+                                           is used, by setting the playout delay. Must be a power of 2 */
+#define AUDIO_SAMPLE_RATE   AUDIO_RENDER_RATE   /* 48kHz audio */
+#define AUDIO_BLOCK_FRAMES  96          /* Render 2ms of audio at a time */
+#define AUDIO_BLOCK_US      (AUDIO_BLOCK_FRAMES * 1000000 / AUDIO_SAMPLE_RATE)
 #define AUDIO_SM            3           /* Audio PIO State Machine */
+
+/* Jitter buffer. The playout delay, used when a channel starts after running dry, is a multiple of the
+ * arrival jitter plus a margin that grows with each underrun and shrinks again while there are none */
+#define AUDIO_MIN_PLAYOUT_US        2000
+#define AUDIO_MAX_PLAYOUT_US        40000
+#define AUDIO_JITTER_MULT           4           /* Playout delay per us of jitter */
+#define AUDIO_UNDERRUN_STEP_US      2000        /* Margin added for each underrun */
+#define AUDIO_DECAY_STEP_US         500         /* Margin removed after AUDIO_TARGET_UNDERRUN_MS without an underrun */
+#define AUDIO_TARGET_UNDERRUN_MS    5000        /* Target is fewer than one underrun in this time */
+#define AUDIO_DECAY_BLOCKS          (AUDIO_TARGET_UNDERRUN_MS * (AUDIO_SAMPLE_RATE / 1000) / AUDIO_BLOCK_FRAMES)
+
+/* Drift compensation. A PI controller on the buffered audio (smoothed over 2^AUDIO_FILL_SHIFT blocks) against the
+ * playout delay sets how fast the renderer's timeline runs, so the Altair's clock is followed rather than
+ * the queue slowly filling or draining. The integral term converges on the drift between the two clocks */
+#define AUDIO_FILL_SHIFT            6
+#define AUDIO_DRIFT_KP_DIV          4           /* 1ppm per 4us of error */
+#define AUDIO_DRIFT_KI_DIV          20000       /* 1ppm per 20000us of error per block */
 #define audio_pio __CONCAT(pio, PICO_AUDIO_I2S_PIO)
 #define GPIO_FUNC_PIOx __CONCAT(GPIO_FUNC_PIO, PICO_AUDIO_I2S_PIO)
+#define AUDIO_DMA_IRQ __CONCAT(DMA_IRQ_, PICO_AUDIO_I2S_DMA_IRQ)
+
+/* Audio is set up before video, so uses fixed DMA channels clear of the scanline channel scanvideo claims (0) */
+#define AUDIO_DMA_CHANNEL           1           /* First of the 2 channels used */
+
+static uint32_t audio_blocks[2][AUDIO_BLOCK_FRAMES];    /* 16 bit PCM for L & R channels = 32 bits per frame */
+static int audio_dma_chan[2];           /* Each DMA channel plays one block then chains to the other */
+static uint32_t audio_queue_bufs[2][AUDIO_QUEUE_LEN];
+static audio_ring_t audio_queues[2];    /* Queue of audio samples for left and right channels */
+
+static audio_renderer_t renderer;     /* Turns queued samples into PCM frames */
 
-bool play_audio_sample_cb(struct repeating_timer *t);
+/* Arrivals and queue contents for each channel */
+static struct
+{
+    uint32_t last_arrival_us;           /* time_us_32() when the last sample was added */
+    uint32_t jitter_q4;                 /* RFC 3550 interarrival jitter, in 1/16 us */
+    uint32_t pushed_us;                 /* Total delay of all samples added. Only written by audio_add_sample() */
+    uint32_t popped_us;                 /* Total delay of all samples removed. Only written by the renderer */
+    uint32_t pushed_events;             /* Events queued */
+    uint32_t popped_events;             /* Events removed */
+    uint16_t last_sample;               /* Sample of the last event queued */
+    bool held;                          /* An event is held back because the queue was full */
+    uint16_t held_sample;
+    uint32_t held_delay_us;             /* May be longer than an event can hold once events are combined */
+    uint32_t carry_us;                  /* Time held_sample (or last_sample) has played through merged events,
+                                           to be added to the delay of the next event queued */
+} audio_chans[2];
 
-static uint32_t current_sample = 0;     /* The currently playing 16 bit PCM for L & R channels = 32 bits */
-static bool have_delay[2];              /* Have we recevied a delay for how long to play this sample yet? */            
-static uint16_t next_sample[2];         /* The next PCM sample value to play */    
-static absolute_time_t next_delay[2];   /* how long to play the current (not next) PCM sample */
-static absolute_time_t sample_time;     /* Time current sample was sent to DAC */
-static alarm_pool_t *audio_alarm_pool;  /* Create a separate alarm pool for audio which can't be shared */
-static queue_t chan0_queue;             /* Queue of audio samples for left channel */
-static queue_t chan1_queue;             /* Queue of audio samples for right channel */
+static struct
+{
+    uint32_t playout_us;                /* Current playout delay */
+    uint32_t margin_us;                 /* Added to the playout delay for underruns */
+    uint32_t seen_underruns;            /* renderer.underruns when last checked */
+    uint32_t quiet_blocks;              /* Blocks since the last underrun or decay of the margin */
+    uint32_t overflows;
+    uint32_t merged;                    /* Events with the same sample combined while the queue was full */
+    uint32_t folded;                    /* Samples shorter than a frame removed while the queue was full */
+    uint32_t dropped;                   /* Longer samples removed while the queue was full */
+} jitter_buffer;
+
+static struct
+{
+    bool tracking;                      /* A channel is playing, so the fill level means something */
+    int32_t fill_q6;                    /* Smoothed buffered audio in 1/64 us */
+    int32_t integral;                   /* Sum of the error, in us blocks */
+    int32_t ppm;                        /* Current correction */
+} drift;
+
+static struct
+{
+    uint32_t blocks;                    /* Blocks rendered */
+    uint32_t render_us;                 /* Time spent rendering blocks */
+    uint32_t max_render_us;
+    uint32_t max_queued[2];             /* Deepest each queue has been */
+    uint32_t tx_stalls;                 /* Blocks during which the PIO found its TX FIFO empty */
+    uint32_t latency_probes;            /* Events timed from audio_add_sample() to leaving the PIO */
+    uint64_t total_latency_us;
+    uint32_t max_latency_us;
+} audio_stats;
+
+#if DAZ_STATS > 0
+/* One event at a time is followed through the queue to measure its latency */
+static struct
+{
+    volatile bool active;
+    uint8_t channel;
+    uint32_t event;                     /* Count of events queued on the channel when it was queued */
+    uint32_t arrival_us;
+} latency_probe;
+#endif
 
 /* Set PIO State machine frequency to be multiple of sample frequency. 
  * Required so that state machine clocks out the data bits at the correct rate
@@ -94,10 +178,170 @@ static void dazzler_audio_i2s_setup(const audio_format_t *intended_audio_format,
     audio_i2s_program_init(audio_pio, sm, offset, config->data_pin, config->clock_pin_base);
 }
 
+/* Event source for the renderer */
+static bool __time_critical_func(audio_pop_sample)(int channel, uint32_t *delay_and_sample, void *ctx)
+{
+    if (!audio_ring_pop(&audio_queues[channel], delay_and_sample))
+    {
+        return false;
+    }
+    audio_chans[channel].popped_us += *delay_and_sample >> 16;
+    audio_chans[channel].popped_events++;
+
+#if DAZ_STATS > 0
+    if (latency_probe.active && latency_probe.channel == channel && audio_chans[channel].popped_events == latency_probe.event)
+    {
+        /* The event's sample is due at the end of its delay, or after the prefill if the channel has run dry.
+         * The block being rendered is played after the one playing now */
+        uint32_t due = renderer.chan[channel].active ?
+            renderer.chan[channel].next_time + (*delay_and_sample >> 16) * AUDIO_UNITS_PER_US :
+            renderer.time + renderer.prefill;
+        int32_t ahead_us = (int32_t) (due - renderer.time) / AUDIO_UNITS_PER_US;
+        uint32_t latency_us = time_us_32() - latency_probe.arrival_us + AUDIO_BLOCK_US + MAX(ahead_us, 0);
+        STATS_INC(audio_stats.latency_probes);
+        STATS_ADD(audio_stats.total_latency_us, latency_us);
+        STATS_MAX(audio_stats.max_latency_us, latency_us);
+        latency_probe.active = false;
+    }
+#endif
+    return true;
+}
+
+/* Size the playout delay for the next time a channel starts, from the jitter and the underruns so far */
+static void __time_critical_func(update_playout_delay)(void)
+{
+    uint32_t underruns = renderer.underruns;
+    if (underruns != jitter_buffer.seen_underruns)
+    {
+        jitter_buffer.margin_us += (underruns - jitter_buffer.seen_underruns) * AUDIO_UNDERRUN_STEP_US;
+        if (jitter_buffer.margin_us > AUDIO_MAX_PLAYOUT_US)
+        {
+            jitter_buffer.margin_us = AUDIO_MAX_PLAYOUT_US;
+        }
+        jitter_buffer.seen_underruns = underruns;
+        jitter_buffer.quiet_blocks = 0;
+    }
+    else if (++jitter_buffer.quiet_blocks >= AUDIO_DECAY_BLOCKS)
+    {
+        jitter_buffer.margin_us = (jitter_buffer.margin_us > AUDIO_DECAY_STEP_US) ? jitter_buffer.margin_us - AUDIO_DECAY_STEP_US : 0;
+        jitter_buffer.quiet_blocks = 0;
+    }
+
+    uint32_t jitter_q4 = MAX(audio_chans[0].jitter_q4, audio_chans[1].jitter_q4);
+    uint32_t playout_us = AUDIO_MIN_PLAYOUT_US + AUDIO_JITTER_MULT * (jitter_q4 >> 4) + jitter_buffer.margin_us;
+    jitter_buffer.playout_us = MIN(playout_us, AUDIO_MAX_PLAYOUT_US);
+    renderer.prefill = jitter_buffer.playout_us * AUDIO_UNITS_PER_US;
+}
+
+/* Audio buffered ahead of playback on a channel: its queued delays plus the time until its next sample.
+ * Returns false if the channel is not playing */
+static bool __time_critical_func(channel_latency_us)(int channel, uint32_t *latency_us)
+{
+    if (!renderer.chan[channel].active)
+    {
+        return false;
+    }
+    int32_t next_us = (int32_t) (renderer.chan[channel].next_time - renderer.time) / AUDIO_UNITS_PER_US;
+    *latency_us = audio_chans[channel].pushed_us - audio_chans[channel].popped_us + MAX(next_us, 0);
+    return true;
+}
+
+/* Adjust the renderer's rate to keep the buffered audio at the playout delay */
+static void __time_critical_func(update_drift)(void)
+{
+    uint32_t latency_us = 0;
+    uint32_t chan_latency_us;
+    bool playing = false;
+    for (int ch = 0 ; ch < 2 ; ch++)
+    {
+        if (channel_latency_us(ch, &chan_latency_us))
+        {
+            latency_us = MAX(latency_us, chan_latency_us);
+            playing = true;
+        }
+    }
+    if (!playing)
+    {
+        /* Keep the correction, as the clocks will still differ when the audio starts again */
+        drift.tracking = false;
+        return;
+    }
+    if (!drift.tracking)
+    {
+        drift.fill_q6 = latency_us << AUDIO_FILL_SHIFT;
+        drift.tracking = true;
+    }
+    drift.fill_q6 += latency_us - (drift.fill_q6 >> AUDIO_FILL_SHIFT);
+
+    /* Positive error is too much buffered, so play faster */
+    int32_t error = (drift.fill_q6 >> AUDIO_FILL_SHIFT) - (int32_t) jitter_buffer.playout_us;
+    int32_t max_integral = AUDIO_RENDER_MAX_DRIFT_PPM * AUDIO_DRIFT_KI_DIV;
+    drift.integral = MAX(MIN(drift.integral + error, max_integral), -max_integral);
+    drift.ppm = error / AUDIO_DRIFT_KP_DIV + drift.integral / AUDIO_DRIFT_KI_DIV;
+    drift.ppm = MAX(MIN(drift.ppm, AUDIO_RENDER_MAX_DRIFT_PPM), -AUDIO_RENDER_MAX_DRIFT_PPM);
+    audio_render_set_drift(&renderer, drift.ppm);
+}
+
+/* Called when a DMA channel has finished playing its block. The other channel is already playing
+ * the next block, so refill this one and re-arm it to be triggered when the other finishes */
+static void __time_critical_func(audio_dma_irq_handler)(void)
+{
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        if (dma_irqn_get_channel_status(PICO_AUDIO_I2S_DMA_IRQ, audio_dma_chan[i]))
+        {
+            dma_irqn_acknowledge_channel(PICO_AUDIO_I2S_DMA_IRQ, audio_dma_chan[i]);
+#if DAZ_STATS > 0
+            uint32_t start = time_us_32();
+#endif
+            audio_render_block(&renderer, (int16_t *) audio_blocks[i], AUDIO_BLOCK_FRAMES);
+            dma_channel_set_read_addr(audio_dma_chan[i], audio_blocks[i], false);
+            update_playout_delay();
+            update_drift();
+#if DAZ_STATS > 0
+            uint32_t render_us = time_us_32() - start;
+            STATS_INC(audio_stats.blocks);
+            STATS_ADD(audio_stats.render_us, render_us);
+            STATS_MAX(audio_stats.max_render_us, render_us);
+
+            /* The PIO stalls when it finds the TX FIFO empty, which is a gap in the audio */
+            uint32_t tx_stall = 1u << (PIO_FDEBUG_TXSTALL_LSB + AUDIO_SM);
+            if (audio_pio->fdebug & tx_stall)
+            {
+                audio_pio->fdebug = tx_stall;
+                STATS_INC(audio_stats.tx_stalls);
+            }
+#endif
+        }
+    }
+}
+
+/* Set up 2 DMA channels to feed the PIO TX FIFO, each chaining to the other when its block is finished */
+static void audio_dma_init(void)
+{
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        audio_dma_chan[i] = AUDIO_DMA_CHANNEL + i;
+        dma_channel_claim(audio_dma_chan[i]);
+    }
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        dma_channel_config c = dma_channel_get_default_config(audio_dma_chan[i]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pio_get_dreq(audio_pio, AUDIO_SM, true));
+        channel_config_set_chain_to(&c, audio_dma_chan[i ^ 1]);
+        dma_channel_configure(audio_dma_chan[i], &c, &audio_pio->txf[AUDIO_SM], audio_blocks[i], AUDIO_BLOCK_FRAMES, false);
+        dma_irqn_set_channel_enabled(PICO_AUDIO_I2S_DMA_IRQ, audio_dma_chan[i], true);
+    }
+    irq_set_exclusive_handler(AUDIO_DMA_IRQ, audio_dma_irq_handler);
+    irq_set_enabled(AUDIO_DMA_IRQ, true);
+    dma_channel_start(audio_dma_chan[0]);
+}
+
 /* Initialise I2S Audio */
 void audio_init() {
-    static repeating_timer_t audio_timer;
-
     /* Dazzler uses signed 8 bit data, but this is converted to signed 16 bit data */
     static audio_format_t audio_format = 
     {
@@ -106,132 +350,333 @@ void audio_init() {
         .channel_count = 2,
     };
 
-    /* Make sure to use an unused DMA channel and PIO state machine */
+    /* Make sure to use an unused PIO state machine. DMA channels are claimed when DMA is set up */
     struct audio_i2s_config config = {
             .data_pin = PICO_AUDIO_I2S_DATA_PIN,
             .clock_pin_base = PICO_AUDIO_I2S_CLOCK_PIN_BASE,
-            .dma_channel = 1,
             .pio_sm = AUDIO_SM,
     };
 
     dazzler_audio_i2s_setup(&audio_format, &config);
     dazzler_update_pio_frequency(audio_format.sample_freq, config.pio_sm);
+
+    audio_ring_init(&audio_queues[0], audio_queue_bufs[0], AUDIO_QUEUE_LEN);
+    audio_ring_init(&audio_queues[1], audio_queue_bufs[1], AUDIO_QUEUE_LEN);
+    audio_render_init(&renderer, audio_pop_sample, NULL);
+    update_playout_delay();
+
+    /* Blocks start out silent. The PIO is paced by the DMA from here on */
+    audio_dma_init();
     pio_sm_set_enabled(audio_pio, config.pio_sm, true);
+}
 
-    queue_init(&chan0_queue, 4, AUDIO_QUEUE_LEN);
-    queue_init(&chan1_queue, 4, AUDIO_QUEUE_LEN);
-    audio_alarm_pool = alarm_pool_create(HWALARM_NUM, 1);
+/* Queue an event. Delays too long for one event are split, by first queueing the last sample again.
+ * Returns false, queueing nothing, if there is not enough room */
+static bool queue_event(int channel, uint32_t delay_us, uint16_t sample)
+{
+    audio_ring_t *queue = &audio_queues[channel];
+    uint32_t fillers = (delay_us > 0xffff) ? (delay_us - 1) / 0xffff : 0;
+    if (AUDIO_QUEUE_LEN - audio_ring_count(queue) < fillers + 1)
+    {
+        return false;
+    }
+#if DAZ_STATS > 0
+    /* Set up the probe first, as the renderer may take the event as soon as it is queued */
+    if (!latency_probe.active)
+    {
+        latency_probe.channel = channel;
+        latency_probe.event = audio_chans[channel].pushed_events + fillers + 1;
+        latency_probe.arrival_us = time_us_32();
+        latency_probe.active = true;
+    }
+#endif
+    audio_chans[channel].pushed_us += delay_us;
+    audio_chans[channel].pushed_events += fillers + 1;
+    for ( ; fillers ; fillers--)
+    {
+        audio_ring_push(queue, (0xffffu << 16) | audio_chans[channel].last_sample);
+        delay_us -= 0xffff;
+    }
+    audio_ring_push(queue, (delay_us << 16) | sample);
+    audio_chans[channel].last_sample = sample;
 
-    /* Wait for alarms system to fully initialise, otherwise can get occasional assertion failures */
-    sleep_ms(100);
-    alarm_pool_add_repeating_timer_us(audio_alarm_pool,-ALARM_FREQ, play_audio_sample_cb, NULL, &audio_timer);
+#if DAZ_STATS > 0
+    uint32_t queued = audio_ring_count(queue);
+    STATS_MAX(audio_stats.max_queued[channel], queued);
+#endif
+    return true;
 }
 
-/* Called every 20us for 48kHz audio. Find the correct PCM value to play and output it to it I2S PIO state machine.
- * The I2S audio chip is clocked from the data clock so this must be called every ~20.833us, otherwise audio chip 
- * will fail to output anything. We use 20 us, which seems to work */
-bool __time_critical_func(play_audio_sample_cb)(struct repeating_timer *t) 
+/* Interarrival jitter (RFC 3550): how far the time since the last samples arrived differs from their total delay,
+ * smoothed over 16 arrivals. Gaps too long to be in the same stream are not counted */
+static void track_arrival(int channel, uint32_t delay_us)
 {
-    absolute_time_t current_time = get_absolute_time();
+    uint32_t now = time_us_32();
+    uint32_t gap_us = now - audio_chans[channel].last_arrival_us;
+    audio_chans[channel].last_arrival_us = now;
+    if (gap_us < AUDIO_RENDER_UNDERRUN_US)
+    {
+        int32_t d = (int32_t) (gap_us - delay_us);
+        audio_chans[channel].jitter_q4 += (d < 0 ? -d : d) - (audio_chans[channel].jitter_q4 >> 4);
+    }
+}
 
-    /* If current PCM sample has played long enough */
-    if (have_delay[0] && absolute_time_diff_us(next_delay[0], current_time) >= 0)
+/* Queue a 16 bit sample, or combine it with the event held back while the queue is full */
+static void enqueue_sample(int channel, uint16_t delay_us, uint16_t value)
+{
+    if (audio_chans[channel].held)
+    {
+        /* Try to queue the held back event first, so the order is kept */
+        audio_task();
+    }
+    if (!audio_chans[channel].held)
     {
-        /* update current sample from store next sample */
-        current_sample = (current_sample & 0xffff00000) | next_sample[0];
+        uint32_t event_delay_us = delay_us + audio_chans[channel].carry_us;
+        audio_chans[channel].carry_us = 0;
+        if (queue_event(channel, event_delay_us, value))
+        {
+            return;
+        }
+        jitter_buffer.overflows++;
+        PRINT_INFO("Chan%d audio queue full\n", channel);
+        audio_chans[channel].held = true;
+        audio_chans[channel].held_delay_us = event_delay_us;
+        audio_chans[channel].held_sample = value;
+        return;
+    }
 
-        uint32_t delay_and_sample;
-        if (queue_try_remove(&chan0_queue, &delay_and_sample))
+    /* Queue is still full, so combine with the held back event without losing any time */
+    jitter_buffer.overflows++;
+    if (value == audio_chans[channel].held_sample)
+    {
+        /* No change in the waveform, the held sample just plays for longer */
+        audio_chans[channel].carry_us += delay_us;
+        jitter_buffer.merged++;
+    }
+    else
+    {
+        /* Remove the held sample, the sample before it plays for its time instead */
+        uint32_t pulse_us = audio_chans[channel].carry_us + delay_us;
+        if (pulse_us * AUDIO_SAMPLE_RATE < 1000000)
         {
-            /* If another sample is queued, then set next_delay (which is how long to play the current sample)
-             * and next_sample (which is the next sample to play) */
-            next_delay[0] = delayed_by_us(next_delay[0], (delay_and_sample >> 16));
-            next_sample[0] = delay_and_sample & 0x0000ffff;
-            have_delay[0] = true;
+            jitter_buffer.folded++;
         }
         else
         {
-            /* Otherwise the current sample will play once and then queue will time out */
-            have_delay[0] = false;
-            current_sample &= 0xffff0000;
+            jitter_buffer.dropped++;
         }
+        audio_chans[channel].held_delay_us += pulse_us;
+        audio_chans[channel].held_sample = value;
+        audio_chans[channel].carry_us = 0;
     }
-    else if (!have_delay[0])
+}
+
+
+/* Add a PCM sample to the left or right channel. 
+ * Sample is the 8 bit sample to play 
+ * Delay in microseconds is how long to play the previous sample */
+void audio_add_sample(uint8_t channel, uint16_t delay_us, uint8_t sample)
+{
+    channel = channel ? 1 : 0;
+    track_arrival(channel, delay_us);
+    /* Convert 8 but sample to 16 bit sample, required by I2S audio */
+    enqueue_sample(channel, delay_us, sample << 8);
+}
+
+/* Add count PCM samples to the left or right channel, as audio_add_sample().
+ * The samples arrived together, so they count as one arrival for the jitter estimate */
+void audio_add_samples(uint8_t channel, const uint16_t *delays_us, const uint8_t *samples, int count)
+{
+    channel = channel ? 1 : 0;
+    audio_ring_t *queue = &audio_queues[channel];
+    uint32_t total_us = 0;
+    for (int i = 0 ; i < count ; i++)
     {
-        /* Queue has timed out */
-        uint32_t delay_and_sample;
-        if (queue_try_remove(&chan0_queue, &delay_and_sample))
-        {
-            /* If a new sample has arrived, then wait 5ms to build up more samples */
-            have_delay[0] = true;
-            next_delay[0] = delayed_by_us(current_time, 5000);
-            next_sample[0] = delay_and_sample & 0x0000ffff;
-        }
+        total_us += delays_us[i];
     }
-    /* Same logic for the right channel */
-    if (have_delay[1] && absolute_time_diff_us(next_delay[1], current_time) >= 0)
-    {
-        current_sample = (current_sample & 0x0000ffff) | (next_sample[1]<< 16);
+    track_arrival(channel, total_us);
 
-        uint32_t delay_and_sample;
-        if (queue_try_remove(&chan1_queue, &delay_and_sample))
+    if (audio_chans[channel].held || audio_chans[channel].carry_us || AUDIO_QUEUE_LEN - audio_ring_count(queue) < count)
+    {
+        /* Not enough room, so go through the overflow handling one at a time */
+        for (int i = 0 ; i < count ; i++)
         {
-            next_delay[1] = delayed_by_us(next_delay[1], (delay_and_sample >> 16));
-            next_sample[1] = delay_and_sample & 0x0000ffff;
-            have_delay[1] = true;
+            enqueue_sample(channel, delays_us[i], samples[i] << 8);
         }
-        else
+        return;
+    }
+
+    /* Queue in batches, publishing each batch to the renderer in one go */
+    uint32_t values[32];
+#if DAZ_STATS > 0
+    if (!latency_probe.active)
+    {
+        latency_probe.channel = channel;
+        latency_probe.event = audio_chans[channel].pushed_events + count;
+        latency_probe.arrival_us = time_us_32();
+        latency_probe.active = true;
+    }
+#endif
+    audio_chans[channel].pushed_us += total_us;
+    audio_chans[channel].pushed_events += count;
+    audio_chans[channel].last_sample = samples[count - 1] << 8;
+    for (int done = 0 ; done < count ; )
+    {
+        int batch = MIN(count - done, (int) (sizeof(values) / sizeof(values[0])));
+        for (int i = 0 ; i < batch ; i++)
         {
-            have_delay[1] = false;
-            current_sample &= 0x0000ffff;
+            values[i] = (delays_us[done + i] << 16) | (samples[done + i] << 8);
         }
+        audio_ring_push_batch(queue, values, batch);
+        done += batch;
     }
-    else if (!have_delay[1])
+#if DAZ_STATS > 0
+    uint32_t queued = audio_ring_count(queue);
+    STATS_MAX(audio_stats.max_queued[channel], queued);
+#endif
+}
+
+/* Queue any event held back while a queue was full. Called from the main loop */
+void audio_task(void)
+{
+    for (int ch = 0 ; ch < 2 ; ch++)
     {
-        uint32_t delay_and_sample;
-        if (queue_try_remove(&chan1_queue, &delay_and_sample))
+        if (audio_chans[ch].held && queue_event(ch, audio_chans[ch].held_delay_us, audio_chans[ch].held_sample))
         {
-            have_delay[1] = true;
-            next_delay[1] = delayed_by_us(current_time, 5000);
-            next_sample[1] = delay_and_sample & 0x0000ffff;
+            audio_chans[ch].held = false;
         }
     }
-    /* Finally send the sample to the state machine */
-    pio_sm_put(audio_pio, AUDIO_SM, current_sample);
-    return true;
 }
 
-/* Add a PCM sample to the left or right channel. 
- * Sample is the 8 bit sample to play 
- * Delay in microseconds is how long to play the previous sample */
-void audio_add_sample(uint8_t channel, uint16_t delay_us, uint8_t sample)
+/* True if neither channel is playing or has events queued, so audio can be stalled without a glitch */
+bool audio_idle(void)
 {
-    if (channel == 0)
+    for (int ch = 0 ; ch < 2 ; ch++)
     {
-        /* Convert 8 but sample to 16 bit sample, required by I2S audio */
-        uint32_t value = (delay_us << 16) | (sample << 8);
-        if (queue_try_add(&chan0_queue, &value) == false)
+        if (renderer.chan[ch].active || audio_chans[ch].held ||
+            audio_chans[ch].pushed_events != audio_chans[ch].popped_events)
         {
-            PRINT_INFO("Chan0 audio queue full\n");
+            return false;
         }
     }
-    else
+    return true;
+}
+
+/* Report the jitter buffer state. Latency is the audio queued plus the time until each channel's next sample */
+void audio_get_status(audio_status_t *status)
+{
+    uint32_t latency_us = 0;
+    uint32_t chan_latency_us;
+    for (int ch = 0 ; ch < 2 ; ch++)
     {
-        uint32_t value = (delay_us << 16) | (sample << 8);
-        if (queue_try_add(&chan1_queue, &value) == false)
+        if (channel_latency_us(ch, &chan_latency_us))
         {
-            PRINT_INFO("Chan1 audio queue full\n");
+            latency_us = MAX(latency_us, chan_latency_us);
         }
     }
-    return;
+    status->latency_us = latency_us;
+    status->playout_us = jitter_buffer.playout_us;
+    status->jitter_us = MAX(audio_chans[0].jitter_q4, audio_chans[1].jitter_q4) >> 4;
+    status->underruns = renderer.underruns;
+    status->overflows = jitter_buffer.overflows;
+    status->merged = jitter_buffer.merged;
+    status->folded = jitter_buffer.folded;
+    status->dropped = jitter_buffer.dropped;
+    status->drift_ppm = drift.ppm;
+}
+
+#if DAZ_STATS > 0
+void audio_print_stats(void)
+{
+    audio_status_t status;
+    audio_get_status(&status);
+
+    /* Each block is AUDIO_BLOCK_US of audio */
+    uint32_t audio_us = audio_stats.blocks * AUDIO_BLOCK_US;
+    uint32_t cycles_per_us = clock_get_hz(clk_sys) / 1000000;
+    printf("Audio: %lu blocks, render avg %lu max %lu us (%lu cycles) per block, %lu.%02lu%% of core 0, %lu TX stalls\n",
+           audio_stats.blocks,
+           audio_stats.blocks ? audio_stats.render_us / audio_stats.blocks : 0,
+           audio_stats.max_render_us,
+           audio_stats.blocks ? audio_stats.render_us / audio_stats.blocks * cycles_per_us : 0,
+           audio_us ? audio_stats.render_us * 100 / audio_us : 0,
+           audio_us ? (uint32_t) ((uint64_t) audio_stats.render_us * 10000 / audio_us) % 100 : 0,
+           audio_stats.tx_stalls);
+    printf("Audio queues: L %lu max %lu, R %lu max %lu, latency now %lu us, add to PIO avg %lu max %lu us\n",
+           audio_ring_count(&audio_queues[0]), audio_stats.max_queued[0],
+           audio_ring_count(&audio_queues[1]), audio_stats.max_queued[1],
+           status.latency_us,
+           audio_stats.latency_probes ? (uint32_t) (audio_stats.total_latency_us / audio_stats.latency_probes) : 0,
+           audio_stats.max_latency_us);
+    printf("Audio jitter buffer: playout %lu us, jitter %lu us, drift %ld ppm, %lu underruns, "
+           "%lu overflows (%lu merged, %lu folded, %lu dropped)\n",
+           status.playout_us, status.jitter_us, status.drift_ppm, status.underruns,
+           status.overflows, status.merged, status.folded, status.dropped);
+    audio_stats.blocks = 0;
+    audio_stats.render_us = 0;
+    audio_stats.max_render_us = 0;
+    audio_stats.max_queued[0] = 0;
+    audio_stats.max_queued[1] = 0;
+    audio_stats.latency_probes = 0;
+    audio_stats.total_latency_us = 0;
+    audio_stats.max_latency_us = 0;
 }
+#endif
 
 /* Test audio output */
 #if DAZAUDIO_STANDALONE
 void audio_add_sample(uint8_t channel, uint16_t delay_us, uint8_t sample);
+
+#define BENCH_EVENTS    16384
+#define BENCH_BATCH     16
+
+/* Compare the cost of moving events through a queue_t and through an audio_ring_t */
+static void audio_queue_benchmark(void)
+{
+    static queue_t queue;
+    static uint32_t ring_buf[AUDIO_QUEUE_LEN];
+    static audio_ring_t ring;
+    uint32_t batch[BENCH_BATCH];
+    uint32_t value;
+    uint32_t cycles_per_us = clock_get_hz(clk_sys) / 1000000;
+
+    queue_init(&queue, 4, AUDIO_QUEUE_LEN);
+    uint32_t start = time_us_32();
+    for (uint32_t i = 0 ; i < BENCH_EVENTS ; i++)
+    {
+        queue_try_add(&queue, &i);
+        queue_try_remove(&queue, &value);
+    }
+    uint32_t queue_us = time_us_32() - start;
+    queue_free(&queue);
+
+    audio_ring_init(&ring, ring_buf, AUDIO_QUEUE_LEN);
+    start = time_us_32();
+    for (uint32_t i = 0 ; i < BENCH_EVENTS ; i++)
+    {
+        audio_ring_push(&ring, i);
+        audio_ring_pop(&ring, &value);
+    }
+    uint32_t ring_us = time_us_32() - start;
+
+    start = time_us_32();
+    for (uint32_t i = 0 ; i < BENCH_EVENTS ; i += BENCH_BATCH)
+    {
+        audio_ring_push_batch(&ring, batch, BENCH_BATCH);
+        audio_ring_pop_batch(&ring, batch, BENCH_BATCH);
+    }
+    uint32_t batch_us = time_us_32() - start;
+
+    printf("Add + remove, cycles per event: queue_t %lu, ring %lu, ring batch of %d %lu\n",
+           queue_us * cycles_per_us / BENCH_EVENTS,
+           ring_us * cycles_per_us / BENCH_EVENTS,
+           BENCH_BATCH, batch_us * cycles_per_us / BENCH_EVENTS);
+}
+
 int main() {
 
     stdio_init_all();
+    audio_queue_benchmark();
     audio_init();
     int timeout = 2000;
 
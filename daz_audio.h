@@ -23,10 +23,31 @@
  *
  */
 #ifndef _AUDIO_H_
+#define _AUDIO_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+
+/* Current state of the audio jitter buffer */
+typedef struct
+{
+    uint32_t latency_us;        /* Audio buffered ahead of playback, longest of the two channels */
+    uint32_t playout_us;        /* Delay before a channel starts playing after it has run dry */
+    uint32_t jitter_us;         /* Estimated arrival jitter of DAC events, larger of the two channels */
+    uint32_t underruns;         /* Times a channel ran dry mid stream */
+    uint32_t overflows;         /* Samples that arrived while a queue was full */
+    uint32_t merged;            /* of which had the same sample as the one before, so were combined with it */
+    uint32_t folded;            /* of which followed a sample shorter than a frame, which was removed */
+    uint32_t dropped;           /* of which followed a longer sample, which was removed */
+    int32_t drift_ppm;          /* Playback speed correction for the Altair's clock */
+} audio_status_t;
 
 void audio_init(void) ;
 void audio_add_sample(uint8_t channel, uint16_t delay_us, uint8_t sample);
+void audio_add_samples(uint8_t channel, const uint16_t *delays_us, const uint8_t *samples, int count);
+void audio_task(void);
+bool audio_idle(void);
+void audio_get_status(audio_status_t *status);
+void audio_print_stats(void);
 
 #endif
\ No newline at end of file
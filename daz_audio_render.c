@@ -0,0 +1,213 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Sample accurate renderer for Dazzler DAC events.
+ * Each event is placed at the frame nearest to its accumulated time on the 48kHz timeline, and every event due
+ * within a block is applied, even when several fall within one frame. Runs between events are filled without
+ * looking at the queue again.
+ * Steps are band-limited with a minBLEP residual, which only costs anything for the BLEP_TAPS samples after a step.
+ */
+#include "daz_audio_render.h"
+
+#if PICO_ON_DEVICE
+#include "pico/platform.h"
+#else
+#define __time_critical_func(func_name) func_name
+#endif
+
+/* Band-limited step minus the naive step, in Q14, for a step of 1 between -0.5 and +0.5 samples before the sample
+ * it was rounded to (phase 0 to BLEP_PHASES - 1) and each of the BLEP_TAPS samples from there on.
+ * Generated by tools/blepgen.py */
+static const int16_t blep_residual[BLEP_PHASES][BLEP_TAPS] =
+{
+    { -16384, -16341, -12835,   -296,   1092,   -429,     75,     -8 },
+    { -16384, -16317, -12239,    306,    840,   -366,     64,     -6 },
+    { -16384, -16283, -11589,    836,    595,   -300,     53,     -4 },
+    { -16384, -16237, -10888,   1288,    364,   -234,     41,     -3 },
+    { -16384, -16175, -10139,   1661,    151,   -171,     29,     -1 },
+    { -16384, -16095,  -9348,   1954,    -38,   -112,     19,      0 },
+    { -16384, -15992,  -8522,   2166,   -201,    -60,     10,      0 },
+    { -16384, -15862,  -7666,   2302,   -335,    -15,      2,      1 },
+    { -16384, -15701,  -6792,   2364,   -441,     22,     -3,      1 },
+    { -16384, -15505,  -5907,   2359,   -517,     51,     -8,      1 },
+    { -16383, -15270,  -5022,   2293,   -567,     72,    -11,      1 },
+    { -16382, -14991,  -4148,   2174,   -590,     86,    -12,      1 },
+    { -16380, -14665,  -3294,   2011,   -590,     93,    -13,      1 },
+    { -16375, -14289,  -2473,   1812,   -571,     95,    -12,      0 },
+    { -16369, -13859,  -1693,   1586,   -535,     92,    -11,      0 },
+    { -16358, -13375,   -965,   1343,   -487,     85,    -10,      0 },
+};
+
+void audio_render_init(audio_renderer_t *r, audio_pop_fn pop, void *ctx)
+{
+    r->time = 0;
+    r->time_frac = 0;
+    r->frame_step = AUDIO_UNITS_PER_FRAME << 8;
+    r->pop = pop;
+    r->ctx = ctx;
+    r->blep = true;
+    r->prefill = AUDIO_RENDER_PREFILL_US * AUDIO_UNITS_PER_US;
+    r->underruns = 0;
+    for (int ch = 0 ; ch < 2 ; ch++)
+    {
+        r->chan[ch].active = false;
+        r->chan[ch].current = 0;
+        r->chan[ch].next = 0;
+        r->chan[ch].next_time = 0;
+        r->chan[ch].dry_time = 0;
+        r->chan[ch].has_run_dry = false;
+        for (int i = 0 ; i < BLEP_TAPS ; i++)
+        {
+            r->chan[ch].blep[i] = 0;
+        }
+        r->chan[ch].blep_pos = 0;
+        r->chan[ch].blep_left = 0;
+    }
+}
+
+/* Play the timeline ppm parts per million faster (positive) or slower than real time, to match the sender's clock */
+void audio_render_set_drift(audio_renderer_t *r, int32_t ppm)
+{
+    ppm = (ppm > AUDIO_RENDER_MAX_DRIFT_PPM) ? AUDIO_RENDER_MAX_DRIFT_PPM : (ppm < -AUDIO_RENDER_MAX_DRIFT_PPM) ? -AUDIO_RENDER_MAX_DRIFT_PPM : ppm;
+    r->frame_step = (AUDIO_UNITS_PER_FRAME << 8) + (int32_t) ((int64_t) ppm * (AUDIO_UNITS_PER_FRAME << 8) / 1000000);
+}
+
+/* True when neither channel has anything left to play */
+bool audio_render_idle(const audio_renderer_t *r)
+{
+    return !r->chan[0].active && !r->chan[1].active;
+}
+
+static inline int16_t clamp16(int32_t value)
+{
+    return (value > INT16_MAX) ? INT16_MAX : (value < INT16_MIN) ? INT16_MIN : value;
+}
+
+/* Queue the correction for a step of height in the current sample. Offset is how far (in timeline units)
+ * the sample it was rounded to is after the true time of the step, and frame is the length of a sample */
+static inline void __time_critical_func(add_step)(audio_render_chan_t *c, int32_t height, int32_t offset, int32_t frame)
+{
+    int phase = (offset >= frame) ? BLEP_PHASES - 1 : (offset * BLEP_PHASES + frame * BLEP_PHASES / 2) / frame;
+    phase = (phase < 0) ? 0 : (phase >= BLEP_PHASES) ? BLEP_PHASES - 1 : phase;
+    const int16_t *residual = blep_residual[phase];
+    for (int i = 0 ; i < BLEP_TAPS ; i++)
+    {
+        c->blep[(c->blep_pos + i) & (BLEP_TAPS - 1)] += (height * residual[i]) >> 14;
+    }
+    c->blep_left = BLEP_TAPS;
+}
+
+/* Play the current sample into every second sample of out from pos up to end. Returns end */
+static inline int __time_critical_func(fill)(audio_render_chan_t *c, int16_t *out, int pos, int end)
+{
+    int16_t value = c->current;
+
+    /* Samples just after a step */
+    for ( ; c->blep_left && pos < end ; pos++)
+    {
+        out[pos * 2] = clamp16(value + c->blep[c->blep_pos]);
+        c->blep[c->blep_pos] = 0;
+        c->blep_pos = (c->blep_pos + 1) & (BLEP_TAPS - 1);
+        c->blep_left--;
+    }
+    for ( ; pos < end ; pos++)
+    {
+        out[pos * 2] = value;
+    }
+    return pos;
+}
+
+/* Render one channel into every second sample of the interleaved frames */
+static void __time_critical_func(render_channel)(audio_renderer_t *r, int channel, int16_t *out, int nr_frames)
+{
+    audio_render_chan_t *c = &r->chan[channel];
+    int32_t frame = r->frame_step >> 8;     /* Fraction of a unit per frame is only kept between blocks */
+    uint32_t delay_and_sample;
+    int pos = 0;
+
+    while (pos < nr_frames)
+    {
+        if (!c->active)
+        {
+            if (!r->pop(channel, &delay_and_sample, r->ctx))
+            {
+                break;
+            }
+            /* Channel has run dry, so wait for the prefill delay after the new sample arrives to build up more samples */
+            uint32_t now = r->time + pos * frame;
+            if (c->has_run_dry && now - c->dry_time < AUDIO_RENDER_UNDERRUN_US * AUDIO_UNITS_PER_US)
+            {
+                r->underruns++;
+            }
+            c->active = true;
+            c->next = (int16_t) (delay_and_sample & 0x0000ffff);
+            c->next_time = now + r->prefill;
+        }
+
+        /* Frame nearest to the time the next sample is due, relative to the start of the block */
+        int32_t due = (int32_t) (c->next_time - r->time);
+        int end = (due <= 0) ? 0 : (due + frame / 2) / frame;
+        if (end >= nr_frames)
+        {
+            fill(c, out, pos, nr_frames);
+            return;
+        }
+
+        /* Play the current sample up to that frame, then step to the next sample */
+        pos = fill(c, out, pos, (end > pos) ? end : pos);
+        int16_t previous = c->current;
+        c->current = c->next;
+        if (r->pop(channel, &delay_and_sample, r->ctx))
+        {
+            c->next_time += (delay_and_sample >> 16) * AUDIO_UNITS_PER_US;
+            c->next = (int16_t) (delay_and_sample & 0x0000ffff);
+        }
+        else
+        {
+            /* Otherwise the queue has run dry */
+            c->active = false;
+            c->current = 0;
+            c->dry_time = r->time + pos * frame;
+            c->has_run_dry = true;
+        }
+        if (r->blep && c->current != previous)
+        {
+            add_step(c, c->current - previous, pos * frame - due, frame);
+        }
+    }
+
+    /* Inactive for the rest of the block */
+    fill(c, out, pos, nr_frames);
+}
+
+/* Render interleaved left / right frames and advance the timeline */
+void __time_critical_func(audio_render_block)(audio_renderer_t *r, int16_t *frames, int nr_frames)
+{
+    render_channel(r, 0, frames, nr_frames);
+    render_channel(r, 1, frames + 1, nr_frames);
+    uint64_t advance = (uint64_t) nr_frames * r->frame_step + r->time_frac;
+    r->time += (uint32_t) (advance >> 8);
+    r->time_frac = advance & 0xff;
+}
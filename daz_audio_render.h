@@ -0,0 +1,89 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __DAZ_AUDIO_RENDER_H__
+#define __DAZ_AUDIO_RENDER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Renders queued Dazzler DAC events to 48kHz stereo PCM.
+ * Has no Pico dependencies so the same code renders captured event streams on the host.
+ *
+ * Events are 32 bit values of (delay_us << 16) | 16 bit signed sample, where delay is how long to play
+ * the *previous* sample. Event times are accumulated on a timeline of 1/1536 us units, on which one
+ * 48kHz frame is exactly 32000 units, so there is no rounding drift however many events are played.
+ * The timeline can be made to advance slightly faster or slower than the output with audio_render_set_drift(),
+ * to follow the clock of the sender. The step per frame is kept in 1/256 units for this.
+ */
+#define AUDIO_RENDER_RATE           48000
+#define AUDIO_UNITS_PER_US          1536
+#define AUDIO_UNITS_PER_FRAME       32000
+#define AUDIO_RENDER_MAX_DRIFT_PPM  1000
+#define AUDIO_RENDER_PREFILL_US     5000    /* Default delay before starting to play when a channel has run dry */
+#define AUDIO_RENDER_UNDERRUN_US    65536   /* A channel restarting within this time of running dry has underrun, as
+                                               the 16 bit delay of an event can't span a longer gap in the stream */
+
+/*
+ * Each step is band-limited by adding a precomputed minimum phase residual (minBLEP) to the output samples
+ * after it, so the square waves from the DAC do not alias. BLEP_PHASES is the sub-sample resolution of a step.
+ */
+#define BLEP_TAPS                   8
+#define BLEP_PHASES                 16
+
+/* Returns the next queued event for the channel, or false if there is none */
+typedef bool (*audio_pop_fn)(int channel, uint32_t *delay_and_sample, void *ctx);
+
+typedef struct
+{
+    bool active;                /* Have we recevied a delay for how long to play the current sample yet? */
+    int16_t current;            /* The currently playing PCM sample */
+    int16_t next;               /* The next PCM sample to play */
+    uint32_t next_time;         /* Timeline position at which next becomes current */
+    uint32_t dry_time;          /* Timeline position at which the channel last ran dry */
+    bool has_run_dry;
+    int32_t blep[BLEP_TAPS];    /* Step corrections still to be added to the next BLEP_TAPS samples */
+    uint8_t blep_pos;           /* Entry in blep for the next sample */
+    uint8_t blep_left;          /* Samples until all corrections have been played */
+} audio_render_chan_t;
+
+typedef struct
+{
+    uint32_t time;              /* Timeline position of the next frame to render */
+    uint32_t time_frac;         /* and its fraction of a unit, in 1/256 units */
+    uint32_t frame_step;        /* Timeline advance per frame, in 1/256 units */
+    audio_render_chan_t chan[2];
+    audio_pop_fn pop;
+    void *ctx;
+    bool blep;                  /* Band-limit steps. Set by audio_render_init() */
+    uint32_t prefill;           /* Delay before starting to play when a channel has run dry, in timeline units */
+    uint32_t underruns;         /* Channels that ran dry then restarted within AUDIO_RENDER_UNDERRUN_US */
+} audio_renderer_t;
+
+void audio_render_init(audio_renderer_t *r, audio_pop_fn pop, void *ctx);
+void audio_render_block(audio_renderer_t *r, int16_t *frames, int nr_frames);
+bool audio_render_idle(const audio_renderer_t *r);
+void audio_render_set_drift(audio_renderer_t *r, int32_t ppm);
+
+#endif
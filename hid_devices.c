@@ -27,11 +27,132 @@
 #include "hid_devices.h"
 #include "usb_joystick.h"
 #include "usb_kbd.h"
+#include "stats.h"
 
 #define DEBUG_INFO  (DEBUG_JOYSTICK + DEBUG_KEYOARD)
 #define DEBUG_TRACE (TRACE_JOYSTICK + TRACE_KEYBOARD)
 #include "debug.h"
 
+/* 
+ * Reports are requested again as soon as one is received, so input is read at the device's own
+ * polling interval. If a request can't be queued, it is retried from hid_task()
+ */
+static struct
+{
+    uint8_t dev_addr;
+    uint8_t instance;
+} retry_requests[CFG_TUH_HID];
+static int nr_retry_requests = 0;
+
+/* Set while a received report is being processed, to measure the latency to the Altair */
+static bool in_report = false;
+static absolute_time_t report_arrival;
+
+static struct
+{
+    uint32_t reports;               /* Reports received from all devices */
+    uint32_t retries;               /* Report requests that had to be retried */
+} hid_stats;
+
+#if DAZ_STATS > 0
+/*
+ * Latency from report arrival to the message being written to the CDC interface, per device.
+ * Bucket i counts messages sent in less than 128us << i, the last bucket counts everything slower.
+ */
+#define HID_LATENCY_BUCKETS 8
+
+static struct hid_device_stats
+{
+    uint8_t  dev_addr;              /* 0 if the slot is not in use */
+    uint8_t  instance;
+    uint32_t received;              /* Reports received */
+    uint32_t changed;               /* Reports that changed the joystick or keyboard state */
+    uint32_t sent;                  /* Messages written to the CDC interface */
+    uint32_t change_max_us;         /* Worst case time from report arrival to the change being found */
+    uint64_t change_total_us;
+    uint32_t pending;               /* Messages staged but not yet written */
+    absolute_time_t pending_arrival;/* Arrival of the report for the oldest pending message */
+    uint32_t latency[HID_LATENCY_BUCKETS];
+} device_stats[CFG_TUH_HID];
+
+static struct hid_device_stats *report_device;     /* Device of the report being processed */
+
+/* Find the stats slot for a device, or a free slot if add is set */
+static struct hid_device_stats *hid_find_device_stats(uint8_t dev_addr, uint8_t instance, bool add)
+{
+    struct hid_device_stats *free_slot = NULL;
+    for (int i = 0 ; i < CFG_TUH_HID ; i++)
+    {
+        if (device_stats[i].dev_addr == dev_addr && device_stats[i].instance == instance)
+        {
+            return &device_stats[i];
+        }
+        if (device_stats[i].dev_addr == 0 && free_slot == NULL)
+        {
+            free_slot = &device_stats[i];
+        }
+    }
+    if (add && free_slot)
+    {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->dev_addr = dev_addr;
+        free_slot->instance = instance;
+        return free_slot;
+    }
+    return NULL;
+}
+
+/* Record that the report being processed changed the joystick or keyboard state */
+void hid_stats_changed(void)
+{
+    if (in_report && report_device)
+    {
+        uint32_t latency = (uint32_t) absolute_time_diff_us(report_arrival, get_absolute_time());
+        report_device->changed++;
+        report_device->change_total_us += latency;
+        STATS_MAX(report_device->change_max_us, latency);
+    }
+}
+
+/* Record that a message for the report being processed has been staged by usb_send_bytes */
+void hid_stats_staged(void)
+{
+    if (in_report && report_device)
+    {
+        if (report_device->pending == 0)
+        {
+            report_device->pending_arrival = report_arrival;
+        }
+        report_device->pending++;
+    }
+}
+
+/* Record that the staged messages have been written to the CDC interface, or dropped if not written */
+void hid_stats_sent(bool written)
+{
+    absolute_time_t now = get_absolute_time();
+    for (int i = 0 ; i < CFG_TUH_HID ; i++)
+    {
+        struct hid_device_stats *dev = &device_stats[i];
+        if (dev->dev_addr && dev->pending)
+        {
+            if (written)
+            {
+                uint32_t latency = (uint32_t) absolute_time_diff_us(dev->pending_arrival, now);
+                int bucket = 0;
+                for (latency >>= 7 ; latency && bucket < HID_LATENCY_BUCKETS - 1 ; latency >>= 1)
+                {
+                    bucket++;
+                }
+                dev->latency[bucket] += dev->pending;
+                dev->sent += dev->pending;
+            }
+            dev->pending = 0;
+        }
+    }
+}
+#endif
+
 /* Invoked when hid device is mounted */
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
 {
@@ -42,6 +163,9 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
 
     printf("HID Interface Protocol = %s\r\n", protocol_str[itf_protocol]);
+#if DAZ_STATS > 0
+    hid_find_device_stats(dev_addr, instance, true);
+#endif
  
 #if DEBUG_INFO > 0
     for (int i = 0 ; i < desc_len ; i++)
@@ -63,10 +187,34 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     }
 }
 
+/* Remove a device from the report requests to retry */
+static void hid_cancel_retry(uint8_t dev_addr, uint8_t instance)
+{
+    int n = 0;
+    for (int i = 0 ; i < nr_retry_requests ; i++)
+    {
+        if (retry_requests[i].dev_addr != dev_addr || retry_requests[i].instance != instance)
+        {
+            retry_requests[n++] = retry_requests[i];
+        }
+    }
+    nr_retry_requests = n;
+}
+
 /* Invoked when HID device is unmounted */
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 {
     printf("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
+#if DAZ_STATS > 0
+    struct hid_device_stats *dev = hid_find_device_stats(dev_addr, instance, false);
+    if (dev)
+    {
+        dev->dev_addr = 0;
+    }
+#endif
+    /* Its address may be given to another device, which must not be sent its requests */
+    hid_cancel_retry(dev_addr, instance);
+
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
         switch(itf_protocol)
     {
@@ -108,7 +256,7 @@ bool tuh_descriptor_get_hid_report_cb(uint16_t vid, uint16_t pid, uint8_t **desc
         0x06, 0x00, 0xFF, 0x81, 0x03, 0x75, 0x01, 0x95, 0x04, 0x06, 0x00, 0xFF, 0x81, 0x02, 
         0x95, 0x0C, 0x15, 0x00, 0x25, 0x01, 0x05, 0x09, 0x81, 0x02, 0x75, 0x08, 0x95, 0x04, 
         0x06, 0x00, 0xFF, 0x81, 0x03, 0xC0, 0xA1, 0x00, 0x75, 0x10, 0x95, 0x02, 0x15, 0x00, 
-        0x27, 0xFF, 0xFF, 0x00, 0x00, 0x09, 0x30, 0x09, 0x31, 0x81, 0x03, 0xC0, 0xC0
+        0x27, 0xFF, 0xFF, 0x00, 0x00, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x81, 0x03, 0xC0, 0xC0
     };
     
     if (!is_xbox_controller(pid))
@@ -119,9 +267,54 @@ bool tuh_descriptor_get_hid_report_cb(uint16_t vid, uint16_t pid, uint8_t **desc
     return true;
 }
 
+/* Request the next report from a device. Failed requests are retried by hid_task while the device is mounted */
+void hid_request_report(uint8_t dev_addr, uint8_t instance)
+{
+    if (!tuh_hid_mounted(dev_addr, instance))
+        return;
+
+    bool result = tuh_hid_receive_report(dev_addr, instance);
+    PRINT_TRACE("tuh_hid_receive_report(%d, %d) = %d\n", dev_addr, instance, result);
+    if (result)
+        return;
+    for (int i = 0 ; i < nr_retry_requests ; i++)
+    {
+        if (retry_requests[i].dev_addr == dev_addr && retry_requests[i].instance == instance)
+            return;
+    }
+    if (nr_retry_requests < CFG_TUH_HID)
+    {
+        retry_requests[nr_retry_requests].dev_addr = dev_addr;
+        retry_requests[nr_retry_requests].instance = instance;
+        nr_retry_requests++;
+        STATS_INC(hid_stats.retries);
+    }
+}
+
+/* Returns true if a HID report is being processed, and sets arrival to the time it was received */
+bool hid_current_report_time(absolute_time_t *arrival)
+{
+    if (in_report)
+    {
+        *arrival = report_arrival;
+    }
+    return in_report;
+}
+
 /* Invoked when received report from device via interrupt endpoint */
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
+    report_arrival = get_absolute_time();
+    in_report = true;
+    STATS_INC(hid_stats.reports);
+#if DAZ_STATS > 0
+    report_device = hid_find_device_stats(dev_addr, instance, false);
+    if (report_device)
+    {
+        report_device->received++;
+    }
+#endif
+
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
     PRINT_TRACE("HID Report Received for %d:%d:%d\n", dev_addr, instance, itf_protocol);
     switch (itf_protocol)
@@ -137,11 +330,42 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
             joy_process_hid_report(dev_addr, instance, report, len);
         break;
     }
+    in_report = false;
+
+    /* Only devices that have been claimed ever request reports, so ask for the next one */
+    hid_request_report(dev_addr, instance);
 }
 
-/* Poll connected USB devices for input */
-void hid_schedule_device_poll(void)
+/* Retry any report requests that could not be queued */
+void hid_task(void)
 {
-    joy_schedule_hid_input();
-    kbd_schedule_hid_input();
-}
\ No newline at end of file
+    int nr_requests = nr_retry_requests;
+    nr_retry_requests = 0;
+    for (int i = 0 ; i < nr_requests ; i++)
+    {
+        hid_request_report(retry_requests[i].dev_addr, retry_requests[i].instance);
+    }
+}
+
+#if DAZ_STATS > 0
+void hid_print_stats(void)
+{
+    printf("HID: %lu reports, %lu request retries\n", hid_stats.reports, hid_stats.retries);
+    for (int i = 0 ; i < CFG_TUH_HID ; i++)
+    {
+        struct hid_device_stats *dev = &device_stats[i];
+        if (dev->dev_addr == 0)
+        {
+            continue;
+        }
+        printf("HID %d:%d: %lu received, %lu changed, %lu sent, report to change avg %lu us max %lu us\n",
+               dev->dev_addr, dev->instance, dev->received, dev->changed, dev->sent,
+               dev->changed ? (uint32_t) (dev->change_total_us / dev->changed) : 0, dev->change_max_us);
+        printf("HID %d:%d: report to CDC write <128us %lu, <256us %lu, <512us %lu, <1ms %lu, <2ms %lu, <4ms %lu, <8ms %lu, slower %lu\n",
+               dev->dev_addr, dev->instance,
+               dev->latency[0], dev->latency[1], dev->latency[2], dev->latency[3],
+               dev->latency[4], dev->latency[5], dev->latency[6], dev->latency[7]);
+        dev->change_max_us = 0;
+    }
+}
+#endif
\ No newline at end of file
@@ -25,7 +25,28 @@
 #ifndef __HID_DEVICES_H__
 #define __HID_DEVICES_H__
 
-/* Poll all connected HID devices for input */
-void hid_schedule_device_poll(void);
+#include "pico/stdlib.h"
+
+/* Request the next input report from a HID device */
+void hid_request_report(uint8_t dev_addr, uint8_t instance);
+
+/* Retry report requests that could not be queued */
+void hid_task(void);
+
+/* Returns true if a HID report is being processed, and sets arrival to the time it was received */
+bool hid_current_report_time(absolute_time_t *arrival);
+
+/* Per-device input latency, from report arrival to the change being found, the message staged and written */
+#if DAZ_STATS > 0
+void hid_stats_changed(void);
+void hid_stats_staged(void);
+void hid_stats_sent(bool written);
+#else
+#define hid_stats_changed()         {}
+#define hid_stats_staged()          {}
+#define hid_stats_sent(written)     {}
+#endif
+
+void hid_print_stats(void);
 
 #endif
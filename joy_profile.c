@@ -0,0 +1,210 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "joy_profile.h"
+
+#define DEBUG_INFO  DEBUG_JOYSTICK
+#define DEBUG_TRACE TRACE_JOYSTICK
+#include "debug.h"
+
+/*
+ * Profiles are stored one per flash page in the last sector of flash, well past the end of the program.
+ * A new profile is written to an empty page and the page of the profile it replaces is then marked unused,
+ * so the sector is only erased when every page has been used.
+ */
+#define PROFILE_OFFSET      (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define PROFILE_SLOTS       (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+_Static_assert(sizeof(joy_profile_t) <= FLASH_PAGE_SIZE, "A profile must fit in a flash page");
+
+/* Page to program, and copy of the profiles while the sector is erased */
+static uint8_t page_buf[FLASH_PAGE_SIZE];
+static joy_profile_t sector_buf[PROFILE_SLOTS];
+
+uint32_t joy_profile_hash(const void *data, uint32_t len)
+{
+    const uint8_t *p = data;
+    uint32_t hash = 2166136261u;
+    while (len--)
+    {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const joy_profile_t *profile_slot(int slot)
+{
+    return (const joy_profile_t *) (XIP_BASE + PROFILE_OFFSET + slot * FLASH_PAGE_SIZE);
+}
+
+static bool profile_valid(const joy_profile_t *profile)
+{
+    return profile->magic == JOY_PROFILE_MAGIC &&
+           profile->check == joy_profile_hash(profile, offsetof(joy_profile_t, check));
+}
+
+static bool slot_empty(int slot)
+{
+    const uint32_t *p = (const uint32_t *) profile_slot(slot);
+    for (int i = 0 ; i < FLASH_PAGE_SIZE / 4 ; i++)
+    {
+        if (p[i] != 0xffffffff)
+            return false;
+    }
+    return true;
+}
+
+/* Return the slot holding the profile for a controller, or -1. The last one wins if there are two */
+static int profile_find_slot(uint16_t vid, uint16_t pid, uint32_t desc_hash)
+{
+    int found = -1;
+    for (int slot = 0 ; slot < PROFILE_SLOTS ; slot++)
+    {
+        const joy_profile_t *profile = profile_slot(slot);
+        if (profile_valid(profile) && profile->vid == vid && profile->pid == pid && profile->desc_hash == desc_hash)
+            found = slot;
+    }
+    return found;
+}
+
+/*
+ * Program a page (or erase the sector if page is NULL). Core 1 is paused and interrupts are disabled,
+ * as no code may run from flash meanwhile. This stops video and audio for about 1ms to program a page
+ * and 50ms to erase the sector.
+ */
+static void profile_flash_write(int slot, const uint8_t *page)
+{
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    if (page != NULL)
+        flash_range_program(PROFILE_OFFSET + slot * FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE);
+    else
+        flash_range_erase(PROFILE_OFFSET, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+}
+
+/* Write a profile to an empty slot */
+static void profile_write(int slot, const joy_profile_t *profile)
+{
+    memset(page_buf, 0xff, sizeof(page_buf));
+    memcpy(page_buf, profile, sizeof(joy_profile_t));
+    profile_flash_write(slot, page_buf);
+}
+
+/* Mark a slot as unused by clearing its magic. Programming leaves the bits that are written as 1 unchanged */
+static void profile_invalidate(int slot)
+{
+    memset(page_buf, 0xff, sizeof(page_buf));
+    memset(page_buf, 0, sizeof(uint32_t));
+    profile_flash_write(slot, page_buf);
+}
+
+/* Erase the sector and write back the profiles in use, except the one in slot skip */
+static void profile_compact(int skip)
+{
+    int nr_profiles = 0;
+    for (int slot = 0 ; slot < PROFILE_SLOTS ; slot++)
+    {
+        if (slot != skip && profile_valid(profile_slot(slot)))
+            sector_buf[nr_profiles++] = *profile_slot(slot);
+    }
+    PRINT_INFO("Compacting profiles, %d kept\n", nr_profiles);
+    profile_flash_write(0, NULL);
+    for (int slot = 0 ; slot < nr_profiles ; slot++)
+        profile_write(slot, &sector_buf[slot]);
+}
+
+bool joy_profile_get(int slot, const joy_profile_t **profile)
+{
+    if (slot < 0 || slot >= PROFILE_SLOTS)
+        return false;
+    *profile = profile_valid(profile_slot(slot)) ? profile_slot(slot) : NULL;
+    return true;
+}
+
+const joy_profile_t *joy_profile_find(uint16_t vid, uint16_t pid, uint32_t desc_hash)
+{
+    int slot = profile_find_slot(vid, pid, desc_hash);
+    return (slot >= 0) ? profile_slot(slot) : NULL;
+}
+
+bool joy_profile_store(joy_profile_t *profile)
+{
+    profile->magic = JOY_PROFILE_MAGIC;
+    profile->check = joy_profile_hash(profile, offsetof(joy_profile_t, check));
+
+    int old_slot = profile_find_slot(profile->vid, profile->pid, profile->desc_hash);
+    int new_slot = -1;
+    for (int slot = 0 ; slot < PROFILE_SLOTS && new_slot < 0 ; slot++)
+    {
+        if (slot_empty(slot))
+            new_slot = slot;
+    }
+    if (new_slot < 0)
+    {
+        /* Make room by dropping the replaced profile and any unused pages */
+        profile_compact(old_slot);
+        old_slot = -1;
+        for (int slot = 0 ; slot < PROFILE_SLOTS && new_slot < 0 ; slot++)
+        {
+            if (slot_empty(slot))
+                new_slot = slot;
+        }
+        if (new_slot < 0)
+        {
+            printf("No room to store profile\n");
+            return false;
+        }
+    }
+
+    /* Write the new profile before removing the old one, so there is always one */
+    profile_write(new_slot, profile);
+    if (old_slot >= 0)
+        profile_invalidate(old_slot);
+
+    PRINT_INFO("Stored profile for %04x:%04x in slot %d\n", profile->vid, profile->pid, new_slot);
+    return profile_valid(profile_slot(new_slot));
+}
+
+bool joy_profile_delete(uint16_t vid, uint16_t pid, uint32_t desc_hash)
+{
+    int slot = profile_find_slot(vid, pid, desc_hash);
+    if (slot < 0)
+        return false;
+    profile_invalidate(slot);
+    return true;
+}
+
+void joy_profile_erase_all(void)
+{
+    profile_flash_write(0, NULL);
+}
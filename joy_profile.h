@@ -0,0 +1,75 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __JOY_PROFILE_H__
+#define __JOY_PROFILE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "parse_descriptor.h"
+
+/*
+ * Controller profiles, stored in the last sector of flash.
+ * A profile holds the compiled joystick definition and the user's settings for a controller,
+ * keyed by VID, PID and a hash of its HID report descriptor, so a controller that has been seen
+ * before is set up without parsing its descriptor.
+ */
+#define JOY_PROFILE_MAGIC   0x33594F4A      /* "JOY3", change if joy_profile_t changes */
+
+typedef struct
+{
+    uint32_t magic;                 /* JOY_PROFILE_MAGIC if in use, 0 once replaced or deleted */
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t desc_hash;             /* Hash of the HID report descriptor */
+    uint8_t  button_map[4];         /* HID button (from 0) used for buttons 1 - 4 */
+    uint8_t  dead_zone;
+    uint8_t  curve;
+    uint8_t  merge_dpad;
+    uint8_t  zero_centered;
+    uint8_t  hysteresis;
+    uint8_t  frame_sync;
+    int32_t  calibration[2][3];     /* X and Y min, centre and max */
+    struct joystick_definition def;
+    uint32_t check;                 /* Hash of the profile up to here */
+} joy_profile_t;
+
+/* Hash of a block of data (32 bit FNV-1a) */
+uint32_t joy_profile_hash(const void *data, uint32_t len);
+
+/* Get the profile in a slot, or NULL if the slot is unused. Returns false past the last slot */
+bool joy_profile_get(int slot, const joy_profile_t **profile);
+
+/* Find the profile for a controller. Returns a pointer into flash, or NULL if there is none */
+const joy_profile_t *joy_profile_find(uint16_t vid, uint16_t pid, uint32_t desc_hash);
+
+/* Store a profile, replacing any profile for the same controller */
+bool joy_profile_store(joy_profile_t *profile);
+
+/* Delete the profile for a controller */
+bool joy_profile_delete(uint16_t vid, uint16_t pid, uint32_t desc_hash);
+
+/* Delete all profiles */
+void joy_profile_erase_all(void);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "kbd_engine.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#include "local_hid.h"
+
+#define DEBUG_INFO  DEBUG_KEYBOARD
+#define DEBUG_TRACE TRACE_KEYBOARD
+#include "debug.h"
+
+#define KBD_SHIFT       (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT)
+#define KBD_CTRL        (KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_RIGHTCTRL)
+
+/* Keycodes 1 - 3 report errors rather than keys */
+#define KBD_KEY_ERROR_ROLLOVER  0x01
+#define KBD_KEY_ERROR_UNDEFINED 0x03
+
+static inline bool kbd_key_held(const uint8_t *keys, uint8_t key)
+{
+    return (keys[key >> 3] >> (key & 7)) & 1;
+}
+
+void kbd_engine_init(kbd_engine_t *kbd, kbd_emit_t emit)
+{
+    memset(kbd, 0, sizeof(*kbd));
+    kbd->emit = emit;
+    kbd->layout = &KBD_LAYOUT;
+    kbd->num_lock = true;
+    kbd->repeat_delay_ms = KBD_REPEAT_DELAY_MS;
+    kbd->repeat_interval_ms = KBD_REPEAT_INTERVAL_MS;
+}
+
+void kbd_engine_set_layout(kbd_engine_t *kbd, const kbd_layout_t *layout)
+{
+    kbd->layout = layout;
+}
+
+void kbd_engine_set_repeat(kbd_engine_t *kbd, uint16_t delay_ms, uint16_t interval_ms)
+{
+    kbd->repeat_delay_ms = delay_ms;
+    kbd->repeat_interval_ms = interval_ms ? interval_ms : 1;
+    if (delay_ms == 0)
+        kbd->repeat_key = 0;
+}
+
+void kbd_format_boot(kbd_format_t *format)
+{
+    memset(format, 0, sizeof(*format));
+    format->report_len = 8;
+    format->nr_runs = 2;
+    format->max_keys = 6;
+    /* Modifiers are the bitmap of keys 0xE0 - 0xE7 */
+    format->runs[0] = (hid_field_run_t) { .bit_offset = 0, .count = 8, .bit_size = 1, .usage_page = HID_USAGE_PAGE_KEYBOARD,
+                                          .usage = HID_KEY_CONTROL_LEFT, .logical_min = 0, .logical_max = 1 };
+    format->runs[1] = (hid_field_run_t) { .bit_offset = 16, .count = 6, .bit_size = 8, .flags = HID_FIELD_ARRAY,
+                                          .usage_page = HID_USAGE_PAGE_KEYBOARD, .usage = 0, .logical_min = 0, .logical_max = 255 };
+}
+
+bool kbd_format_compile(const uint8_t *desc_report, uint16_t desc_len, kbd_format_t *format)
+{
+    static hid_report_map_t map;
+
+    memset(format, 0, sizeof(*format));
+    if (!hid_compile_report_descriptor(desc_report, desc_len, &map))
+        return false;
+
+    /* Keys are read from the first report that has any */
+    for (int r = 0 ; r < map.nr_runs && format->nr_runs < KBD_MAX_KEY_RUNS ; r++)
+    {
+        const hid_field_run_t *run = &map.runs[r];
+        bool array = run->flags & HID_FIELD_ARRAY;
+
+        if (run->usage_page != HID_USAGE_PAGE_KEYBOARD || (run->flags & HID_FIELD_CONSTANT) ||
+            (format->nr_runs > 0 && run->report_id != format->report_id) ||
+            (array ? run->bit_size > 16 : run->bit_size != 1 || (run->flags & HID_FIELD_ONE_USAGE)))
+            continue;
+
+        format->runs[format->nr_runs++] = *run;
+        format->report_id = run->report_id;
+        format->has_report_id = map.has_report_id;
+        uint32_t end = (run->bit_offset + (uint32_t) run->count * run->bit_size + 7) / 8;
+        if (end > format->report_len)
+            format->report_len = end;
+        if (array)
+            format->max_keys += run->count;
+        else if (run->usage < HID_KEY_CONTROL_LEFT)
+            format->max_keys += (run->usage + run->count > HID_KEY_CONTROL_LEFT) ? HID_KEY_CONTROL_LEFT - run->usage : run->count;
+    }
+    PRINT_INFO("Keyboard report %d, %d bytes, %d keys at once\n", format->report_id, format->report_len, format->max_keys);
+    return format->nr_runs > 0;
+}
+
+/* Return the character for a key, with the modifiers, caps lock and num lock applied */
+static uint8_t kbd_translate(const kbd_engine_t *kbd, uint8_t key)
+{
+    uint8_t modifiers = kbd->keys[HID_KEY_CONTROL_LEFT >> 3];
+    uint8_t level;
+
+    if (key >= KBD_LAYOUT_KEYS)
+        return 0;
+    if (modifiers & KBD_CTRL)
+        level = KBD_LEVEL_CTRL;
+    else if (modifiers & KEYBOARD_MODIFIER_RIGHTALT)
+        level = KBD_LEVEL_ALTGR;
+    else
+        level = ((modifiers & KBD_SHIFT) ? KBD_LEVEL_SHIFT : KBD_LEVEL_PLAIN) + (kbd->caps_lock ? KBD_LEVEL_CAPS : 0);
+    if (!kbd->num_lock)
+        level += KBD_LEVEL_NUM_LOCK_OFF;
+    return kbd->layout->map[key][level];
+}
+
+/* Handle a key that has just been pressed */
+static void kbd_press(kbd_engine_t *kbd, uint8_t key, uint32_t now_ms)
+{
+    if (key == HID_KEY_CAPS_LOCK)
+        kbd->caps_lock = !kbd->caps_lock;
+    else if (key == HID_KEY_NUM_LOCK)
+        kbd->num_lock = !kbd->num_lock;
+
+    uint8_t ch = kbd_translate(kbd, key);
+    if (ch)
+    {
+        kbd->emit(ch);
+        /* The last key pressed is the one that repeats */
+        if (kbd->repeat_delay_ms)
+        {
+            kbd->repeat_key = key;
+            kbd->repeat_due_ms = now_ms + kbd->repeat_delay_ms;
+        }
+    }
+    else
+    {
+        PRINT_TRACE("keycode = %d\n", key);
+    }
+}
+
+/* Read an unsigned field of up to 16 bits, that may not be byte aligned */
+static uint32_t kbd_read_field(const uint8_t *report, uint32_t bit, uint8_t size)
+{
+    uint32_t value = 0;
+    for (int i = 0 ; i < size ; i++, bit++)
+        value |= (uint32_t) ((report[bit >> 3] >> (bit & 7)) & 1) << i;
+    return value;
+}
+
+bool kbd_engine_report(kbd_engine_t *kbd, const kbd_format_t *format, const uint8_t *report, uint16_t len, uint32_t now_ms)
+{
+    uint8_t keys[sizeof(kbd->keys)];
+
+    if (len < format->report_len || (format->has_report_id && report[0] != format->report_id))
+        return false;
+
+    memset(keys, 0, sizeof(keys));
+    for (int r = 0 ; r < format->nr_runs ; r++)
+    {
+        const hid_field_run_t *run = &format->runs[r];
+        for (uint32_t n = 0 ; n < run->count ; n++)
+        {
+            uint32_t value = kbd_read_field(report, run->bit_offset + n * run->bit_size, run->bit_size);
+            uint32_t key;
+            if (run->flags & HID_FIELD_ARRAY)
+            {
+                /* Each field holds the keycode of a key held, or a value out of range for none */
+                if ((int32_t) value < run->logical_min || (int32_t) value > run->logical_max)
+                    continue;
+                key = run->usage + value - run->logical_min;
+                /* Too many keys held to tell which, so keep the keys as they were */
+                if (key == KBD_KEY_ERROR_ROLLOVER)
+                    return false;
+                if (key <= KBD_KEY_ERROR_UNDEFINED)
+                    continue;
+            }
+            else
+            {
+                if (!value)
+                    continue;
+                key = run->usage + n;
+            }
+            if (key < 256)
+                keys[key >> 3] |= 1 << (key & 7);
+        }
+    }
+
+    if (!memcmp(keys, kbd->keys, sizeof(keys)))
+        return false;
+
+    /* Update all the keys first, so modifiers pressed in the same report apply to the other keys */
+    uint8_t pressed[sizeof(keys)];
+    for (int i = 0 ; i < sizeof(keys) ; i++)
+    {
+        pressed[i] = keys[i] & ~kbd->keys[i];
+        kbd->keys[i] = keys[i];
+    }
+    if (kbd->repeat_key && !kbd_key_held(keys, kbd->repeat_key))
+        kbd->repeat_key = 0;
+    for (int key = 0 ; key < 256 ; key++)
+    {
+        if (kbd_key_held(pressed, key))
+            kbd_press(kbd, key, now_ms);
+    }
+    return true;
+}
+
+void kbd_engine_task(kbd_engine_t *kbd, uint32_t now_ms)
+{
+    if (kbd->repeat_key == 0 || (int32_t) (now_ms - kbd->repeat_due_ms) < 0)
+        return;
+
+    uint8_t ch = kbd_translate(kbd, kbd->repeat_key);
+    if (ch)
+        kbd->emit(ch);
+    kbd->repeat_due_ms += kbd->repeat_interval_ms;
+    /* If the main loop was held up, carry on from now rather than sending a burst of repeats */
+    if ((int32_t) (now_ms - kbd->repeat_due_ms) >= 0)
+        kbd->repeat_due_ms = now_ms + kbd->repeat_interval_ms;
+}
+
+#ifdef KBD_ENGINE_TEST
+/*
+ * Host test for the keyboard engine. Replays recorded report sequences, calling kbd_engine_task()
+ * every millisecond as the main loop would, and checks the characters sent and when they were sent.
+ *   cc -O2 -fsanitize=address,undefined -DKBD_ENGINE_TEST -o kbd_test kbd_engine.c kbd_layouts.c parse_descriptor.c
+ *   ./kbd_test
+ */
+#include <stdlib.h>
+
+/* Report protocol keyboard with report id 1: modifiers, a reserved byte and a bitmap of keys 0x00 - 0x67 */
+static const uint8_t nkro_descriptor[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00,
+    0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x05, 0x07,
+    0x19, 0x00, 0x29, 0x67, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x68, 0x81, 0x02, 0x95, 0x05,
+    0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+    0xC0
+};
+
+/* The boot keyboard descriptor, as sent by most 6 key rollover keyboards */
+static const uint8_t boot_descriptor[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+    0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+    0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0
+};
+
+struct replay_step
+{
+    uint32_t ms;
+    uint8_t  len;
+    uint8_t  report[16];
+};
+
+struct replay_test
+{
+    const char *name;
+    const uint8_t *desc;            /* NULL for the boot protocol */
+    uint16_t desc_len;
+    const struct replay_step *steps;
+    int nr_steps;
+    uint32_t end_ms;
+    const char *expected;           /* "ms:char" for each character sent, control characters as \xNN */
+    const kbd_layout_t *layout;     /* NULL for the default layout */
+};
+
+#define BOOT(ms, mod, ...)  { ms, 8, { mod, 0, __VA_ARGS__ } }
+#define NKRO(ms, id, mod, ...) { ms, 16, { id, mod, 0, __VA_ARGS__ } }
+
+static const struct replay_step press_steps[] = { BOOT(0, 0, 0x04), BOOT(100, 0, 0) };
+static const struct replay_step repeat_steps[] = { BOOT(0, 0, 0x04), BOOT(700, 0, 0) };
+static const struct replay_step modifier_steps[] = {
+    BOOT(0, 0x02, 0x1e), BOOT(10, 0, 0), BOOT(20, 0, 0x39), BOOT(30, 0, 0), BOOT(40, 0, 0x04), BOOT(50, 0, 0),
+    BOOT(60, 0, 0x1e), BOOT(70, 0, 0), BOOT(80, 0x20, 0x04), BOOT(90, 0, 0), BOOT(100, 0x01, 0x06), BOOT(110, 0, 0),
+    BOOT(120, 0x02, 0), BOOT(130, 0x02, 0x05), BOOT(140, 0, 0)
+};
+static const struct replay_step rollover_steps[] = {
+    BOOT(0, 0, 0x04), BOOT(300, 0, 0x04, 0x05), BOOT(900, 0, 0x04), BOOT(1000, 0, 0)
+};
+static const struct replay_step error_steps[] = {
+    BOOT(0, 0, 0x04), BOOT(10, 0, 1, 1, 1, 1, 1, 1), BOOT(20, 0, 0x04, 0x05), BOOT(30, 0, 0), { 40, 7, { 0, 0, 0x06 } }
+};
+static const struct replay_step layout_steps[] = {
+    BOOT(0, 0, 0x1c), BOOT(10, 0x40, 0x14), BOOT(20, 0x40, 0x24), BOOT(30, 0, 0x53), BOOT(40, 0, 0x59), BOOT(50, 0, 0x53),
+    BOOT(60, 0, 0x59, 0x63), BOOT(70, 0, 0)
+};
+static const struct replay_step nkro_steps[] = {
+    NKRO(0, 1, 0x02, 0xf0, 0x0f), NKRO(50, 2, 0), NKRO(600, 1, 0)
+};
+
+static const struct replay_test tests[] = {
+    { "press", NULL, 0, press_steps, 2, 800, "0:a", NULL },
+    { "repeat", NULL, 0, repeat_steps, 2, 800, "0:a 500:a 533:a 566:a 599:a 632:a 665:a 698:a", NULL },
+    { "modifiers", NULL, 0, modifier_steps, 15, 200, "0:! 40:A 60:1 80:a 100:\\x03 130:b", NULL },
+    { "rollover", NULL, 0, rollover_steps, 4, 1100, "0:a 300:b 800:b 833:b 866:b 899:b", NULL },
+    { "rollover error", NULL, 0, error_steps, 5, 100, "0:a 20:b", NULL },
+    { "nkro", nkro_descriptor, sizeof(nkro_descriptor), nkro_steps, 3, 700,
+      "0:A 0:B 0:C 0:D 0:E 0:F 0:G 0:H 500:H 533:H 566:H 599:H", NULL },
+    { "layout", NULL, 0, layout_steps, 8, 100, "0:z 10:@ 20:{ 60:1 60:,", &kbd_layout_de },
+};
+#define NR_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static uint32_t sim_ms;
+static char output[1024];
+
+static void record(uint8_t ch)
+{
+    size_t len = strlen(output);
+    if (ch >= ' ' && ch < 0x7f)
+        snprintf(output + len, sizeof(output) - len, "%s%lu:%c", len ? " " : "", (unsigned long) sim_ms, ch);
+    else
+        snprintf(output + len, sizeof(output) - len, "%s%lu:\\x%02x", len ? " " : "", (unsigned long) sim_ms, ch);
+}
+
+static int run_test(const struct replay_test *t)
+{
+    kbd_engine_t kbd;
+    kbd_format_t format;
+    int step = 0;
+
+    kbd_engine_init(&kbd, record);
+    if (t->layout)
+        kbd_engine_set_layout(&kbd, t->layout);
+    if (t->desc ? !kbd_format_compile(t->desc, t->desc_len, &format) : (kbd_format_boot(&format), false))
+    {
+        printf("%-14s FAIL: no keys in descriptor\n", t->name);
+        return 0;
+    }
+    output[0] = 0;
+    for (sim_ms = 0 ; sim_ms <= t->end_ms ; sim_ms++)
+    {
+        for ( ; step < t->nr_steps && t->steps[step].ms == sim_ms ; step++)
+            kbd_engine_report(&kbd, &format, t->steps[step].report, t->steps[step].len, sim_ms);
+        kbd_engine_task(&kbd, sim_ms);
+    }
+    int ok = !strcmp(output, t->expected);
+    printf("%-14s %s: %s\n", t->name, ok ? "ok  " : "FAIL", output);
+    if (!ok)
+        printf("%-14s expected %s\n", "", t->expected);
+    return ok;
+}
+
+static void ignore(uint8_t ch)
+{
+    (void) ch;
+}
+
+int main(int argc, char *argv[])
+{
+    kbd_format_t format;
+    int failed = 0;
+
+    for (int t = 0 ; t < NR_TESTS ; t++)
+        failed |= !run_test(&tests[t]);
+
+    /* The report protocol formats must match the keys the descriptors describe */
+    int ok = kbd_format_compile(nkro_descriptor, sizeof(nkro_descriptor), &format) &&
+             format.has_report_id && format.report_id == 1 && format.report_len == 16 && format.max_keys == 0x68;
+    ok = ok && kbd_format_compile(boot_descriptor, sizeof(boot_descriptor), &format) &&
+         !format.has_report_id && format.report_len == 8 && format.max_keys == 6;
+    printf("%-14s %s\n", "formats", ok ? "ok" : "FAIL");
+    failed |= !ok;
+
+    /* Random reports must never leave a key repeating that is not held */
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+    kbd_engine_t kbd;
+    kbd_engine_init(&kbd, ignore);
+    kbd_format_compile(nkro_descriptor, sizeof(nkro_descriptor), &format);
+    srand(1);
+    for (long it = 0 ; it < iterations && !failed ; it++)
+    {
+        uint8_t report[16];
+        for (int i = 0 ; i < sizeof(report) ; i++)
+            report[i] = (rand() & 3) ? 0 : rand();
+        report[0] = 1;
+        kbd_engine_report(&kbd, &format, report, sizeof(report), it);
+        kbd_engine_task(&kbd, it);
+        if (kbd.repeat_key && !kbd_key_held(kbd.keys, kbd.repeat_key))
+        {
+            printf("FAIL: key %d repeating but not held on iteration %ld\n", kbd.repeat_key, it);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#ifndef __KBD_ENGINE_H__
+#define __KBD_ENGINE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "parse_descriptor.h"
+#include "kbd_layouts.h"
+
+/*
+ * Keyboard engine.
+ * Decodes boot and report protocol keyboard reports into the set of keys held, translates each new key
+ * press to a character and repeats the last key pressed while it is held. Repeats are made by
+ * kbd_engine_task() from the main loop, not by polling the keyboard again.
+ * It has no Pico or TinyUSB dependencies, so it can be tested on a PC with recorded reports.
+ */
+#define KBD_MAX_KEY_RUNS        4       /* Keyboard fields (keycode arrays or key bitmaps) decoded per report */
+#define KBD_REPEAT_DELAY_MS     500     /* Default time a key is held before it repeats */
+#define KBD_REPEAT_INTERVAL_MS  33      /* Default time between repeats, about 30 per second */
+
+/* Where the keys are in a keyboard's input report */
+typedef struct
+{
+    uint8_t  has_report_id;
+    uint8_t  report_id;
+    uint8_t  report_len;                /* Shortest report that holds all of the keys */
+    uint8_t  nr_runs;
+    uint16_t max_keys;                  /* Keys, other than modifiers, that can be reported at once */
+    hid_field_run_t runs[KBD_MAX_KEY_RUNS];
+} kbd_format_t;
+
+/* Called with each character typed */
+typedef void (*kbd_emit_t)(uint8_t ch);
+
+typedef struct
+{
+    uint8_t  keys[32];                  /* Keys held, one bit per HID keycode, including the modifiers 0xE0 - 0xE7 */
+    bool     caps_lock;
+    bool     num_lock;
+    const kbd_layout_t *layout;
+    uint8_t  repeat_key;                /* Key being repeated, 0 if none */
+    uint32_t repeat_due_ms;             /* Time of the next repeat */
+    uint16_t repeat_delay_ms;
+    uint16_t repeat_interval_ms;
+    kbd_emit_t emit;
+} kbd_engine_t;
+
+/* Reset the engine, with no keys held, num lock on and the default layout and repeat settings */
+void kbd_engine_init(kbd_engine_t *kbd, kbd_emit_t emit);
+
+/* Select the keyboard layout */
+void kbd_engine_set_layout(kbd_engine_t *kbd, const kbd_layout_t *layout);
+
+/* Set the repeat delay and interval. A delay of 0 turns repeat off */
+void kbd_engine_set_repeat(kbd_engine_t *kbd, uint16_t delay_ms, uint16_t interval_ms);
+
+/* Format of a boot protocol report: modifiers, reserved byte and 6 keycodes */
+void kbd_format_boot(kbd_format_t *format);
+
+/* Find the keys in a report protocol keyboard's HID report descriptor. Returns false if there are none */
+bool kbd_format_compile(const uint8_t *desc_report, uint16_t desc_len, kbd_format_t *format);
+
+/* Process a report received at now_ms. Returns true if the keys held have changed */
+bool kbd_engine_report(kbd_engine_t *kbd, const kbd_format_t *format, const uint8_t *report, uint16_t len, uint32_t now_ms);
+
+/* Repeat the key held if it is due. Called from the main loop */
+void kbd_engine_task(kbd_engine_t *kbd, uint32_t now_ms);
+
+#endif
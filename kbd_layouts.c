@@ -0,0 +1,362 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "kbd_layouts.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Layouts are listed as the plain, shift and AltGr character of each key. KEY() expands these to every level
+ * at compile time: caps lock shifts letters only, and ctrl gives the control character of letters and @ - _.
+ * The levels are repeated for num lock off, which only changes the keypad.
+ */
+#define IS_LOWER(c)         ((c) >= 'a' && (c) <= 'z')
+#define CTRL_OF(c)          (IS_LOWER(c) ? (c) - 0x60 : ((c) > '@' && (c) <= '_') ? (c) - 0x40 : 0)
+#define LEVELS(p, s, a)     p, s, IS_LOWER(p) ? s : p, IS_LOWER(p) ? p : s, CTRL_OF(p), a
+#define KEY(p, s, a)        { LEVELS(p, s, a), LEVELS(p, s, a) }
+
+/* Keypad digits are only typed with num lock on and shift up. Keypad operators ignore the modifiers except ctrl */
+#define PAD(c)              { c, 0, c, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+#define PAD_OP(c)           { c, c, c, c, 0, c, c, c, c, c, 0, c }
+#define KEYPAD(decimal) \
+        [0x54] = PAD_OP('/'), [0x55] = PAD_OP('*'), [0x56] = PAD_OP('-'), [0x57] = PAD_OP('+'), [0x58] = PAD_OP('\r'), \
+        [0x59] = PAD('1'), [0x5a] = PAD('2'), [0x5b] = PAD('3'), [0x5c] = PAD('4'), [0x5d] = PAD('5'), \
+        [0x5e] = PAD('6'), [0x5f] = PAD('7'), [0x60] = PAD('8'), [0x61] = PAD('9'), [0x62] = PAD('0'), \
+        [0x63] = PAD(decimal), [0x67] = PAD_OP('=')
+
+/* US */
+const kbd_layout_t kbd_layout_us = {
+    "us",
+    {
+        [0x04] = KEY('a'   , 'A'   , 0     ),
+        [0x05] = KEY('b'   , 'B'   , 0     ),
+        [0x06] = KEY('c'   , 'C'   , 0     ),
+        [0x07] = KEY('d'   , 'D'   , 0     ),
+        [0x08] = KEY('e'   , 'E'   , 0     ),
+        [0x09] = KEY('f'   , 'F'   , 0     ),
+        [0x0a] = KEY('g'   , 'G'   , 0     ),
+        [0x0b] = KEY('h'   , 'H'   , 0     ),
+        [0x0c] = KEY('i'   , 'I'   , 0     ),
+        [0x0d] = KEY('j'   , 'J'   , 0     ),
+        [0x0e] = KEY('k'   , 'K'   , 0     ),
+        [0x0f] = KEY('l'   , 'L'   , 0     ),
+        [0x10] = KEY('m'   , 'M'   , 0     ),
+        [0x11] = KEY('n'   , 'N'   , 0     ),
+        [0x12] = KEY('o'   , 'O'   , 0     ),
+        [0x13] = KEY('p'   , 'P'   , 0     ),
+        [0x14] = KEY('q'   , 'Q'   , 0     ),
+        [0x15] = KEY('r'   , 'R'   , 0     ),
+        [0x16] = KEY('s'   , 'S'   , 0     ),
+        [0x17] = KEY('t'   , 'T'   , 0     ),
+        [0x18] = KEY('u'   , 'U'   , 0     ),
+        [0x19] = KEY('v'   , 'V'   , 0     ),
+        [0x1a] = KEY('w'   , 'W'   , 0     ),
+        [0x1b] = KEY('x'   , 'X'   , 0     ),
+        [0x1c] = KEY('y'   , 'Y'   , 0     ),
+        [0x1d] = KEY('z'   , 'Z'   , 0     ),
+        [0x1e] = KEY('1'   , '!'   , 0     ),
+        [0x1f] = KEY('2'   , '@'   , 0     ),
+        [0x20] = KEY('3'   , '#'   , 0     ),
+        [0x21] = KEY('4'   , '$'   , 0     ),
+        [0x22] = KEY('5'   , '%'   , 0     ),
+        [0x23] = KEY('6'   , '^'   , 0     ),
+        [0x24] = KEY('7'   , '&'   , 0     ),
+        [0x25] = KEY('8'   , '*'   , 0     ),
+        [0x26] = KEY('9'   , '('   , 0     ),
+        [0x27] = KEY('0'   , ')'   , 0     ),
+        [0x28] = KEY('\r'  , '\r'  , 0     ), /* Enter */
+        [0x29] = KEY('\x1b', '\x1b', 0     ), /* Escape */
+        [0x2a] = KEY('\b'  , '\b'  , 0     ), /* Backspace */
+        [0x2b] = KEY('\t'  , '\t'  , 0     ), /* Tab */
+        [0x2c] = KEY(' '   , ' '   , 0     ), /* Space */
+        [0x2d] = KEY('-'   , '_'   , 0     ),
+        [0x2e] = KEY('='   , '+'   , 0     ),
+        [0x2f] = KEY('['   , '{'   , 0     ),
+        [0x30] = KEY(']'   , '}'   , 0     ),
+        [0x31] = KEY('\\'  , '|'   , 0     ),
+        [0x32] = KEY('#'   , '~'   , 0     ), /* Non-US # and ~ */
+        [0x33] = KEY(';'   , ':'   , 0     ),
+        [0x34] = KEY('\''  , '"'   , 0     ),
+        [0x35] = KEY('`'   , '~'   , 0     ),
+        [0x36] = KEY(','   , '<'   , 0     ),
+        [0x37] = KEY('.'   , '>'   , 0     ),
+        [0x38] = KEY('/'   , '?'   , 0     ),
+        [0x64] = KEY('\\'  , '|'   , 0     ), /* Non-US \ and | */
+        KEYPAD('.')
+    }
+};
+
+/* UK */
+const kbd_layout_t kbd_layout_uk = {
+    "uk",
+    {
+        [0x04] = KEY('a'   , 'A'   , 0     ),
+        [0x05] = KEY('b'   , 'B'   , 0     ),
+        [0x06] = KEY('c'   , 'C'   , 0     ),
+        [0x07] = KEY('d'   , 'D'   , 0     ),
+        [0x08] = KEY('e'   , 'E'   , 0     ),
+        [0x09] = KEY('f'   , 'F'   , 0     ),
+        [0x0a] = KEY('g'   , 'G'   , 0     ),
+        [0x0b] = KEY('h'   , 'H'   , 0     ),
+        [0x0c] = KEY('i'   , 'I'   , 0     ),
+        [0x0d] = KEY('j'   , 'J'   , 0     ),
+        [0x0e] = KEY('k'   , 'K'   , 0     ),
+        [0x0f] = KEY('l'   , 'L'   , 0     ),
+        [0x10] = KEY('m'   , 'M'   , 0     ),
+        [0x11] = KEY('n'   , 'N'   , 0     ),
+        [0x12] = KEY('o'   , 'O'   , 0     ),
+        [0x13] = KEY('p'   , 'P'   , 0     ),
+        [0x14] = KEY('q'   , 'Q'   , 0     ),
+        [0x15] = KEY('r'   , 'R'   , 0     ),
+        [0x16] = KEY('s'   , 'S'   , 0     ),
+        [0x17] = KEY('t'   , 'T'   , 0     ),
+        [0x18] = KEY('u'   , 'U'   , 0     ),
+        [0x19] = KEY('v'   , 'V'   , 0     ),
+        [0x1a] = KEY('w'   , 'W'   , 0     ),
+        [0x1b] = KEY('x'   , 'X'   , 0     ),
+        [0x1c] = KEY('y'   , 'Y'   , 0     ),
+        [0x1d] = KEY('z'   , 'Z'   , 0     ),
+        [0x1e] = KEY('1'   , '!'   , 0     ),
+        [0x1f] = KEY('2'   , '"'   , 0     ),
+        [0x20] = KEY('3'   , 0     , 0     ), /* 3 and pound */
+        [0x21] = KEY('4'   , '$'   , 0     ),
+        [0x22] = KEY('5'   , '%'   , 0     ),
+        [0x23] = KEY('6'   , '^'   , 0     ),
+        [0x24] = KEY('7'   , '&'   , 0     ),
+        [0x25] = KEY('8'   , '*'   , 0     ),
+        [0x26] = KEY('9'   , '('   , 0     ),
+        [0x27] = KEY('0'   , ')'   , 0     ),
+        [0x28] = KEY('\r'  , '\r'  , 0     ), /* Enter */
+        [0x29] = KEY('\x1b', '\x1b', 0     ), /* Escape */
+        [0x2a] = KEY('\b'  , '\b'  , 0     ), /* Backspace */
+        [0x2b] = KEY('\t'  , '\t'  , 0     ), /* Tab */
+        [0x2c] = KEY(' '   , ' '   , 0     ), /* Space */
+        [0x2d] = KEY('-'   , '_'   , 0     ),
+        [0x2e] = KEY('='   , '+'   , 0     ),
+        [0x2f] = KEY('['   , '{'   , 0     ),
+        [0x30] = KEY(']'   , '}'   , 0     ),
+        [0x31] = KEY('#'   , '~'   , 0     ),
+        [0x32] = KEY('#'   , '~'   , 0     ),
+        [0x33] = KEY(';'   , ':'   , 0     ),
+        [0x34] = KEY('\''  , '@'   , 0     ),
+        [0x35] = KEY('`'   , 0     , 0     ), /* ` and not */
+        [0x36] = KEY(','   , '<'   , 0     ),
+        [0x37] = KEY('.'   , '>'   , 0     ),
+        [0x38] = KEY('/'   , '?'   , 0     ),
+        [0x64] = KEY('\\'  , '|'   , 0     ),
+        KEYPAD('.')
+    }
+};
+
+/* German (QWERTZ). Umlauts, sharp s and the dead keys do not type ASCII characters */
+const kbd_layout_t kbd_layout_de = {
+    "de",
+    {
+        [0x04] = KEY('a'   , 'A'   , 0     ),
+        [0x05] = KEY('b'   , 'B'   , 0     ),
+        [0x06] = KEY('c'   , 'C'   , 0     ),
+        [0x07] = KEY('d'   , 'D'   , 0     ),
+        [0x08] = KEY('e'   , 'E'   , 0     ),
+        [0x09] = KEY('f'   , 'F'   , 0     ),
+        [0x0a] = KEY('g'   , 'G'   , 0     ),
+        [0x0b] = KEY('h'   , 'H'   , 0     ),
+        [0x0c] = KEY('i'   , 'I'   , 0     ),
+        [0x0d] = KEY('j'   , 'J'   , 0     ),
+        [0x0e] = KEY('k'   , 'K'   , 0     ),
+        [0x0f] = KEY('l'   , 'L'   , 0     ),
+        [0x10] = KEY('m'   , 'M'   , 0     ),
+        [0x11] = KEY('n'   , 'N'   , 0     ),
+        [0x12] = KEY('o'   , 'O'   , 0     ),
+        [0x13] = KEY('p'   , 'P'   , 0     ),
+        [0x14] = KEY('q'   , 'Q'   , '@'   ),
+        [0x15] = KEY('r'   , 'R'   , 0     ),
+        [0x16] = KEY('s'   , 'S'   , 0     ),
+        [0x17] = KEY('t'   , 'T'   , 0     ),
+        [0x18] = KEY('u'   , 'U'   , 0     ),
+        [0x19] = KEY('v'   , 'V'   , 0     ),
+        [0x1a] = KEY('w'   , 'W'   , 0     ),
+        [0x1b] = KEY('x'   , 'X'   , 0     ),
+        [0x1c] = KEY('z'   , 'Z'   , 0     ),
+        [0x1d] = KEY('y'   , 'Y'   , 0     ),
+        [0x1e] = KEY('1'   , '!'   , 0     ),
+        [0x1f] = KEY('2'   , '"'   , 0     ),
+        [0x20] = KEY('3'   , 0     , 0     ), /* 3 and section */
+        [0x21] = KEY('4'   , '$'   , 0     ),
+        [0x22] = KEY('5'   , '%'   , 0     ),
+        [0x23] = KEY('6'   , '&'   , 0     ),
+        [0x24] = KEY('7'   , '/'   , '{'   ),
+        [0x25] = KEY('8'   , '('   , '['   ),
+        [0x26] = KEY('9'   , ')'   , ']'   ),
+        [0x27] = KEY('0'   , '='   , '}'   ),
+        [0x28] = KEY('\r'  , '\r'  , 0     ), /* Enter */
+        [0x29] = KEY('\x1b', '\x1b', 0     ), /* Escape */
+        [0x2a] = KEY('\b'  , '\b'  , 0     ), /* Backspace */
+        [0x2b] = KEY('\t'  , '\t'  , 0     ), /* Tab */
+        [0x2c] = KEY(' '   , ' '   , 0     ), /* Space */
+        [0x2d] = KEY(0     , '?'   , '\\'  ), /* sharp s, ? and \ */
+        [0x2e] = KEY(0     , '`'   , 0     ), /* Acute and grave */
+        [0x2f] = KEY(0     , 0     , 0     ), /* U umlaut */
+        [0x30] = KEY('+'   , '*'   , '~'   ),
+        [0x31] = KEY('#'   , '\''  , 0     ),
+        [0x32] = KEY('#'   , '\''  , 0     ),
+        [0x33] = KEY(0     , 0     , 0     ), /* O umlaut */
+        [0x34] = KEY(0     , 0     , 0     ), /* A umlaut */
+        [0x35] = KEY('^'   , 0     , 0     ), /* ^ and degree */
+        [0x36] = KEY(','   , ';'   , 0     ),
+        [0x37] = KEY('.'   , ':'   , 0     ),
+        [0x38] = KEY('-'   , '_'   , 0     ),
+        [0x64] = KEY('<'   , '>'   , '|'   ),
+        KEYPAD(',')
+    }
+};
+
+static const kbd_layout_t *const layouts[] = { &kbd_layout_us, &kbd_layout_uk, &kbd_layout_de };
+
+const kbd_layout_t *kbd_layout_find(const char *name)
+{
+    for (int i = 0 ; i < sizeof(layouts) / sizeof(layouts[0]) ; i++)
+    {
+        if (!strcmp(layouts[i]->name, name))
+            return layouts[i];
+    }
+    return NULL;
+}
+
+#ifdef KBD_LAYOUTS_TEST
+/*
+ * Host test for the layout tables
+ *   cc -O2 -DKBD_LAYOUTS_TEST -o layouts_test kbd_layouts.c
+ *   ./layouts_test
+ */
+#include <stdio.h>
+
+struct layout_check
+{
+    const kbd_layout_t *layout;
+    uint8_t key;
+    uint8_t level;
+    uint8_t ch;
+};
+
+/* Keys that differ between the layouts, and the levels made by KEY() */
+static const struct layout_check checks[] = {
+    { &kbd_layout_us, 0x1f, KBD_LEVEL_SHIFT, '@' },
+    { &kbd_layout_us, 0x34, KBD_LEVEL_SHIFT, '"' },
+    { &kbd_layout_us, 0x31, KBD_LEVEL_PLAIN, '\\' },
+    { &kbd_layout_us, 0x2f, KBD_LEVEL_CTRL, 0x1b },
+    { &kbd_layout_us, 0x06, KBD_LEVEL_CTRL, 0x03 },
+    { &kbd_layout_us, 0x1e, KBD_LEVEL_CAPS, '1' },
+    { &kbd_layout_us, 0x04, KBD_LEVEL_CAPS_SHIFT, 'a' },
+    { &kbd_layout_us, 0x59, KBD_LEVEL_PLAIN, '1' },
+    { &kbd_layout_us, 0x59, KBD_LEVEL_PLAIN + KBD_LEVEL_NUM_LOCK_OFF, 0 },
+    { &kbd_layout_us, 0x57, KBD_LEVEL_SHIFT + KBD_LEVEL_NUM_LOCK_OFF, '+' },
+    { &kbd_layout_uk, 0x1f, KBD_LEVEL_SHIFT, '"' },
+    { &kbd_layout_uk, 0x20, KBD_LEVEL_SHIFT, 0 },
+    { &kbd_layout_uk, 0x34, KBD_LEVEL_SHIFT, '@' },
+    { &kbd_layout_uk, 0x32, KBD_LEVEL_PLAIN, '#' },
+    { &kbd_layout_uk, 0x32, KBD_LEVEL_SHIFT, '~' },
+    { &kbd_layout_uk, 0x64, KBD_LEVEL_PLAIN, '\\' },
+    { &kbd_layout_de, 0x1c, KBD_LEVEL_PLAIN, 'z' },
+    { &kbd_layout_de, 0x1d, KBD_LEVEL_PLAIN, 'y' },
+    { &kbd_layout_de, 0x1c, KBD_LEVEL_CTRL, 0x1a },
+    { &kbd_layout_de, 0x14, KBD_LEVEL_ALTGR, '@' },
+    { &kbd_layout_de, 0x24, KBD_LEVEL_ALTGR, '{' },
+    { &kbd_layout_de, 0x27, KBD_LEVEL_SHIFT, '=' },
+    { &kbd_layout_de, 0x2d, KBD_LEVEL_PLAIN, 0 },
+    { &kbd_layout_de, 0x2d, KBD_LEVEL_SHIFT, '?' },
+    { &kbd_layout_de, 0x2d, KBD_LEVEL_CAPS_SHIFT, '?' },
+    { &kbd_layout_de, 0x2d, KBD_LEVEL_ALTGR, '\\' },
+    { &kbd_layout_de, 0x30, KBD_LEVEL_ALTGR, '~' },
+    { &kbd_layout_de, 0x64, KBD_LEVEL_ALTGR, '|' },
+    { &kbd_layout_de, 0x63, KBD_LEVEL_PLAIN, ',' },
+};
+
+static int check_layout(const kbd_layout_t *layout)
+{
+    int ok = kbd_layout_find(layout->name) == layout;
+    int letters[26] = { 0 };
+    int typed[128] = { 0 };
+
+    for (int key = 0 ; key < KBD_LAYOUT_KEYS ; key++)
+    {
+        const uint8_t *levels = layout->map[key];
+        int keypad = key >= 0x54 && key <= 0x67;
+        for (int level = 0 ; level < KBD_LEVELS ; level++)
+        {
+            ok = ok && levels[level] < 0x80;
+            /* Num lock only changes the keypad */
+            if (level < KBD_LEVEL_NUM_LOCK_OFF && !keypad)
+                ok = ok && levels[level] == levels[level + KBD_LEVEL_NUM_LOCK_OFF];
+        }
+        for (int level = 0 ; level < KBD_LEVEL_NUM_LOCK_OFF ; level++)
+            typed[levels[level]]++;
+
+        uint8_t ch = levels[KBD_LEVEL_PLAIN];
+        if (ch >= 'a' && ch <= 'z')
+        {
+            letters[ch - 'a']++;
+            ok = ok && levels[KBD_LEVEL_SHIFT] == ch - 0x20 && levels[KBD_LEVEL_CAPS] == ch - 0x20 &&
+                 levels[KBD_LEVEL_CAPS_SHIFT] == ch && levels[KBD_LEVEL_CTRL] == ch - 0x60;
+        }
+        else
+        {
+            ok = ok && levels[KBD_LEVEL_CAPS] == ch && levels[KBD_LEVEL_CAPS_SHIFT] == levels[KBD_LEVEL_SHIFT];
+        }
+    }
+
+    /* Each letter is on one key, and every printable character can be typed */
+    int nr_typed = 0;
+    for (int i = 0 ; i < 26 ; i++)
+        ok = ok && letters[i] == 1;
+    for (int ch = ' ' ; ch < 0x7f ; ch++)
+    {
+        if (typed[ch])
+            nr_typed++;
+        else
+            printf("%s: '%c' can not be typed\n", layout->name, ch);
+    }
+    ok = ok && nr_typed == 0x7f - ' ' && typed['\r'] && typed['\b'] && typed['\t'] && typed['\x1b'];
+
+    for (int i = 0 ; i < sizeof(checks) / sizeof(checks[0]) ; i++)
+    {
+        if (checks[i].layout == layout && layout->map[checks[i].key][checks[i].level] != checks[i].ch)
+        {
+            printf("%s: key %02x level %d is %02x, expected %02x\n", layout->name, checks[i].key, checks[i].level,
+                   layout->map[checks[i].key][checks[i].level], checks[i].ch);
+            ok = 0;
+        }
+    }
+    printf("%s %s: %d printable characters, %d byte table\n", layout->name, ok ? "ok  " : "FAIL",
+           nr_typed, (int) sizeof(layout->map));
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = kbd_layout_find("xx") != NULL;
+    for (int i = 0 ; i < sizeof(layouts) / sizeof(layouts[0]) ; i++)
+        failed |= !check_layout(layouts[i]);
+    return failed;
+}
+#endif
@@ -0,0 +1,64 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#ifndef __KBD_LAYOUTS_H__
+#define __KBD_LAYOUTS_H__
+
+#include <stdint.h>
+
+/*
+ * Keyboard layouts.
+ * Each layout maps a HID keycode and the modifiers held to the character sent to the Altair, with a single
+ * lookup in map[keycode][level]. Keys that do not type an ASCII character map to 0.
+ */
+#define KBD_LAYOUT_KEYS     0x68    /* Keycodes translated, up to keypad = */
+
+#define KBD_LEVEL_PLAIN         0
+#define KBD_LEVEL_SHIFT         1
+#define KBD_LEVEL_CAPS          2   /* Caps lock on */
+#define KBD_LEVEL_CAPS_SHIFT    3
+#define KBD_LEVEL_CTRL          4
+#define KBD_LEVEL_ALTGR         5
+#define KBD_LEVEL_NUM_LOCK_OFF  6   /* Added to the levels above when num lock is off */
+#define KBD_LEVELS              12
+
+typedef struct
+{
+    const char *name;
+    uint8_t map[KBD_LAYOUT_KEYS][KBD_LEVELS];
+} kbd_layout_t;
+
+extern const kbd_layout_t kbd_layout_us;
+extern const kbd_layout_t kbd_layout_uk;
+extern const kbd_layout_t kbd_layout_de;
+
+/* Layout used until another is selected, set KBD_LAYOUT in CMakeLists.txt to change it */
+#ifndef KBD_LAYOUT
+#define KBD_LAYOUT  kbd_layout_us
+#endif
+
+/* Return the layout with the given name, or NULL if there is none */
+const kbd_layout_t *kbd_layout_find(const char *name);
+
+#endif
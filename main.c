@@ -42,7 +42,11 @@
 #include "hardware/clocks.h"
 
 #include "hid_devices.h"
+#include "usb_joystick.h"
+#include "usb_kbd.h"
 #include "daz_audio.h"
+#include "console.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -60,14 +64,16 @@
 #define HEIGHT  128
 #define NUMCLR  16
 
-#define HID_POLL_MS   10    /* Poll HID devices for input @ 100 times per second */
-
 /* Dazzler packet types */
 #define DAZ_MEMBYTE   0x10
 #define DAZ_FULLFRAME 0x20
 #define DAZ_CTRL      0x30
 #define DAZ_CTRLPIC   0x40
 #define DAZ_DAC       0x50
+#define DAZ_DELTAFRAME 0x60
+#define DAZ_MEMRUN    0x70
+#define DAZ_FRAMEBUF  0x80
+#define DAZ_DACBATCH  0x90
 #define DAZ_VERSION   0xF0
 
 #define DAZ_JOY1      0x10
@@ -82,10 +88,27 @@
 #define FEAT_DAC      0x10
 #define FEAT_KEYBOARD 0x20
 #define FEAT_FRAMEBUF 0x40
+/* Extended features are reported in the second feature byte of the version response */
+#define FEAT_DELTAFRAME 0x0100
+#define FEAT_MEMRUN     0x0200
+#define FEAT_DACBATCH   0x0400
 #define DAZZLER_VERSION 0x02
 
+#define DAZZLER_FEATURES (FEAT_VIDEO | FEAT_DUAL_BUF | FEAT_JOYSTICK | FEAT_DAC | FEAT_VSYNC | FEAT_KEYBOARD | \
+                          FEAT_FRAMEBUF | FEAT_DELTAFRAME | FEAT_MEMRUN | FEAT_DACBATCH)
+
+
+/* DAZ_DELTAFRAME operation codes */
+#define DELTA_LITERAL 0x00
+#define DELTA_REPEAT  0x80
+#define DELTA_SKIP    0xC0
+
+/* DAZ_DACBATCH delay codes */
+#define DDB_DELTA14   0x80              /* 0x00-0x7F is a 7 bit zigzag difference, 0x80-0xBF the top of a 14 bit one */
+#define DDB_ABSOLUTE  0xC0              /* Followed by the 16 bit delay itself */
 
 void set_vram(int buffer_nr, int addr, uint8_t value, bool refresh);
+void set_vram_span(int buffer_nr, int addr, const uint8_t *values, int count);
 void refresh_vram(int buffer_nr);
 
 /*
@@ -118,6 +141,11 @@ enum vid_mode { mode_32x32c, mode_64x64m, mode_64x64c, mode_128x128m } video_mod
 /* Bitmasks for DAZ_CTRL */
 #define DC_ON           0x80
 
+/* Bitmasks and sizes for DAZ_FRAMEBUF */
+#define DFB_COMMIT      0x01            /* Flip to the back buffer after the tiles are written */
+#define DFB_TILE_SIZE   64              /* The 2048 byte frame is sent as 32 tiles of 64 bytes */
+#define DFB_NR_TILES    (2048 / DFB_TILE_SIZE)
+
 /* 16 colours used in colour mode */
 uint16_t    colours[NUMCLR] =
 {
@@ -202,6 +230,9 @@ uint16_t frame_buffers[3][WIDTH * HEIGHT];
  */
 uint8_t raw_frames[2][2048];
 
+/* Picture control (video mode and colours) each frame buffer was last fully drawn with, by refresh_vram */
+uint8_t frame_picture_ctrl[2];
+
 /*************************************************************
  * USB Serial port handling                                  *
  *************************************************************/
@@ -249,10 +280,16 @@ uint8_t usb_peekbyte()
     return result;
 }
 
+void usb_flush_if_due(void);
+
 /* Return the top byte from usb buffer. Block until data is available */
 uint8_t usb_getbyte_blocking()
 {
-    while(!usb_avail()) { tuh_task(); }
+    while(!usb_avail()) 
+    { 
+        tuh_task(); 
+        usb_flush_if_due();
+    }
     return usb_getbyte();
 }
 
@@ -269,16 +306,145 @@ void usb_setbyte(uint8_t byte)
     usb_wr = wr_pos;
 }
 
-/* Send buffer via usb serial port */
+/* 
+ * USB transmit staging buffer.
+ * Messages are collected in the staging buffer and sent to the CDC interface in a single
+ * write at the end of each pass of the main loop. A message is never held for longer than
+ * USB_OUT_DEADLINE_US, so is still sent when the main loop is busy processing video.
+ */
+#define USB_OUT_BUFFER_SIZE 64
+#define USB_OUT_DEADLINE_US 1000
+uint8_t usb_out_buffer[USB_OUT_BUFFER_SIZE];
+int usb_out_count = 0;
+absolute_time_t usb_out_staged_time;    /* When the oldest message in the buffer was staged */
+
+#if DAZ_STATS > 0
+bool usb_out_has_input = false;         /* True if a joystick or keyboard message is staged */
+absolute_time_t usb_out_input_time;     /* When the HID report for the oldest staged input message arrived */
+
+struct
+{
+    uint32_t rx_bytes;                  /* Bytes received from the Altair */
+    uint32_t packets[16];               /* Packets received by type (high nibble) */
+    uint32_t tx_messages;               /* Messages sent to the Altair */
+    uint32_t tx_transactions;           /* CDC writes used to send them */
+    uint32_t tx_max_latency_us;         /* Worst case time a message was held in the staging buffer */
+    uint32_t input_messages;            /* Joystick and keyboard messages sent */
+    uint32_t input_max_staged_us;       /* Worst case time from HID report arrival to usb_send_bytes */
+    uint32_t input_transactions;        /* CDC writes containing joystick or keyboard messages */
+    uint64_t input_total_sent_us;       /* Total time from HID report arrival to the CDC write */
+    uint32_t input_max_sent_us;         /* Worst case time from HID report arrival to the CDC write */
+} usb_stats;
+#endif
+
+/* Send the staged messages via usb serial port */
+void usb_flush_bytes(void)
+{
+    if (usb_out_count)
+    {
+        /* Assumes one CDC interface */
+        if (tuh_cdc_mounted(0))
+        {
+            tuh_cdc_write(0, usb_out_buffer, usb_out_count);
+            tuh_cdc_write_flush(0);
+            STATS_INC(usb_stats.tx_transactions);
+            hid_stats_sent(true);
+        }
+        else
+        {
+            hid_stats_sent(false);
+        }
+#if DAZ_STATS > 0
+        absolute_time_t now = get_absolute_time();
+        uint32_t latency = (uint32_t) absolute_time_diff_us(usb_out_staged_time, now);
+        STATS_MAX(usb_stats.tx_max_latency_us, latency);
+        if (usb_out_has_input)
+        {
+            latency = (uint32_t) absolute_time_diff_us(usb_out_input_time, now);
+            STATS_INC(usb_stats.input_transactions);
+            STATS_ADD(usb_stats.input_total_sent_us, latency);
+            STATS_MAX(usb_stats.input_max_sent_us, latency);
+        }
+        usb_out_has_input = false;
+#endif
+        usb_out_count = 0;
+    }
+}
+
+/* Send the staged messages if the oldest one has been held for too long */
+void usb_flush_if_due(void)
+{
+    if (usb_out_count && 
+        absolute_time_diff_us(usb_out_staged_time, get_absolute_time()) >= USB_OUT_DEADLINE_US)
+    {
+        usb_flush_bytes();
+    }
+}
+
+/* Stage buffer to be sent via usb serial port */
 void usb_send_bytes(uint8_t *buf, int count)
 {
-    /* Assumes one CDC interface */
     if (tuh_cdc_mounted(0) && count)
     {
-        tuh_cdc_write(0, buf, count);
-        tuh_cdc_write_flush(0);
+        if (usb_out_count + count > USB_OUT_BUFFER_SIZE)
+        {
+            usb_flush_bytes();
+        }
+        if (usb_out_count == 0)
+        {
+            usb_out_staged_time = get_absolute_time();
+        }
+        memcpy(&usb_out_buffer[usb_out_count], buf, count);
+        usb_out_count += count;
+        STATS_INC(usb_stats.tx_messages);
+#if DAZ_STATS > 0
+        absolute_time_t arrival;
+        if (hid_current_report_time(&arrival))
+        {
+            uint32_t latency = (uint32_t) absolute_time_diff_us(arrival, get_absolute_time());
+            STATS_INC(usb_stats.input_messages);
+            STATS_MAX(usb_stats.input_max_staged_us, latency);
+            hid_stats_staged();
+            if (!usb_out_has_input)
+            {
+                usb_out_input_time = arrival;
+                usb_out_has_input = true;
+            }
+        }
+#endif
+    }
+}
+
+#if DAZ_STATS > 0
+/* Print runtime statistics to the debug serial port */
+void print_stats(void)
+{
+    printf("USB RX: %lu bytes", usb_stats.rx_bytes);
+    for (int i = 1 ; i < 16 ; i++)
+    {
+        if (usb_stats.packets[i])
+        {
+            printf(", %02X:%lu", i << 4, usb_stats.packets[i]);
+        }
+    }
+    printf("\n");
+    printf("USB TX: %lu messages in %lu transactions (%lu saved), max latency %lu us\n",
+           usb_stats.tx_messages, usb_stats.tx_transactions,
+           usb_stats.tx_messages - usb_stats.tx_transactions, usb_stats.tx_max_latency_us);
+    if (usb_stats.input_transactions)
+    {
+        printf("Input latency: report to usb_send_bytes max %lu us, report to CDC write avg %lu us max %lu us\n",
+               usb_stats.input_max_staged_us,
+               (uint32_t) (usb_stats.input_total_sent_us / usb_stats.input_transactions),
+               usb_stats.input_max_sent_us);
     }
+    hid_print_stats();
+    audio_print_stats();
+    usb_stats.tx_max_latency_us = 0;
+    usb_stats.input_max_staged_us = 0;
+    usb_stats.input_max_sent_us = 0;
 }
+#endif
 
 /*************************************************************
  * USB Serial routines                                       *
@@ -292,6 +458,7 @@ void tuh_cdc_rx_cb(uint8_t idx)
     static uint8_t buf[512];
 
     uint32_t count = tuh_cdc_read(idx, buf, sizeof(buf));
+    STATS_ADD(usb_stats.rx_bytes, count);
 
     for (int i = 0 ; i < count ; i++)
     {
@@ -622,6 +789,22 @@ void __time_critical_func(set_vram)(int buffer_nr, int addr, uint8_t value, bool
     }
 }
 
+/* Set a run of consecutive bytes into raw_frame and frame_buffer.
+ * raw_frame is updated in one copy, and the frame_buffer is then set from the values */
+void __time_critical_func(set_vram_span)(int buffer_nr, int addr, const uint8_t *values, int count)
+{
+    PRINT_TRACE("set_vram_span(%d, %d, %d)\n", buffer_nr, addr, count);
+    if (addr + count > 2048)
+    {
+        count = 2048 - addr;
+    }
+    memcpy(&raw_frames[buffer_nr][addr], values, count);
+    for (int i = 0 ; i < count ; i++)
+    {
+        set_vram(buffer_nr, addr + i, values[i], true);
+    }
+}
+
 /* Used when changing video modes to copy from raw_frame into frame_buffer with the new mode */
 void refresh_vram(int buffer_nr)
 {
@@ -631,6 +814,7 @@ void refresh_vram(int buffer_nr)
     {
         set_vram(buffer_nr, i, raw_frame[i], false);
     }
+    frame_picture_ctrl[buffer_nr] = dazzler_picture_ctrl;
 }
 
 /*************************************************************
@@ -715,8 +899,9 @@ void process_usb_commands()
 {
 
     absolute_time_t abs_time = get_absolute_time();
-    /* poll joystick ~60 times per second */
-    absolute_time_t hid_poll_time = make_timeout_time_ms(HID_POLL_MS);
+#if DAZ_STATS > 0
+    absolute_time_t stats_time = make_timeout_time_ms(STATS_PERIOD_MS);
+#endif
 
     uint8_t c = 0;
 
@@ -727,27 +912,42 @@ void process_usb_commands()
         abs_time = get_absolute_time();
 
         /*
-         * If nothing available on USB, then schedule request to poll joysticks
-         * and service USB tasks.
+         * If nothing available on USB, then send VSYNC and service USB tasks.
+         * HID devices request their next report from the report received callback.
          */
         if (!usb_avail())
         {
             if (send_vsync)
             {
                 static uint8_t vsync = DAZ_VSYNC;
+                joy_vsync();
                 usb_send_bytes(&vsync, 1);
                 send_vsync = false;
             }
-            if (absolute_time_diff_us(hid_poll_time, abs_time) >= 0)
+            hid_task();
+            kbd_task();
+       	    tuh_task();
+            audio_task();
+            console_task();
+            /* Profiles for new controllers are written to flash when the stall will not be seen or heard */
+            if (!(dazzler_ctrl & DC_ON) && audio_idle())
             {
-                hid_schedule_device_poll();
-                hid_poll_time = make_timeout_time_ms(HID_POLL_MS);
+                joy_save_new_profiles();
             }
-       	    tuh_task();
+            /* Send everything staged during this pass in one transaction */
+            usb_flush_bytes();
+#if DAZ_STATS > 0
+            if (absolute_time_diff_us(stats_time, abs_time) >= 0)
+            {
+                print_stats();
+                stats_time = make_timeout_time_ms(STATS_PERIOD_MS);
+            }
+#endif
             continue;
         }
         /* Otherwise service the USB serial */
         c = usb_getbyte();
+        STATS_INC(usb_stats.packets[c >> 4]);
    
         switch (c & 0xF0)
         {
@@ -756,8 +956,8 @@ void process_usb_commands()
                 PRINT_INFO("VERSION\n");
                 static uint8_t buf[3];
                 buf[0] = DAZ_VERSION | (DAZZLER_VERSION & 0x0F);
-                buf[1] = FEAT_VIDEO | FEAT_DUAL_BUF | FEAT_JOYSTICK | FEAT_DAC | FEAT_VSYNC | FEAT_KEYBOARD;
-                buf[2] = 0;
+                buf[1] = DAZZLER_FEATURES & 0xFF;
+                buf[2] = DAZZLER_FEATURES >> 8;
                 usb_send_bytes(buf, 3);
 
                 break;
@@ -806,6 +1006,59 @@ void process_usb_commands()
                 set_vram(buffer_nr, addr, value, false);
                 break;
             }
+            case DAZ_MEMRUN:
+            {
+                /* Same header bits as DAZ_MEMBYTE, followed by the low address byte,
+                 * the run length - 1 and then the bytes to set */
+                static uint8_t values[256];
+                int buffer_nr = (c & 0x08) ? 1 : 0;
+                int addr = (c & 0x07) * 256 + (uint8_t) usb_getbyte_blocking();
+                int count = (uint8_t) usb_getbyte_blocking() + 1;
+                for (int i = 0 ; i < count ; i++)
+                {
+                    values[i] = (uint8_t) usb_getbyte_blocking();
+                }
+                PRINT_INFO("DAZ_MEMRUN %02x, %d, %d, %d\n", c, buffer_nr, addr, count);
+                set_vram_span(buffer_nr, addr, values, count);
+                break;
+            }
+            case DAZ_FRAMEBUF:
+            {
+                /*
+                 * Writes tiles into the buffer that is not being displayed, followed by an optional flip.
+                 * Followed by the first tile number and the number of tiles, then the tile data.
+                 * A whole frame is tiles 0 to 31. A count of 0 can be used to just commit.
+                 */
+                static uint8_t tile[DFB_TILE_SIZE];
+                int buffer_nr = active_frame_buffer ^ 1;
+                int first_tile = (uint8_t) usb_getbyte_blocking();
+                int nr_tiles = (uint8_t) usb_getbyte_blocking();
+                PRINT_INFO("DAZ_FRAMEBUF %02x, %d, %d, %d\n", c, buffer_nr, first_tile, nr_tiles);
+                for (int t = first_tile ; t < first_tile + nr_tiles ; t++)
+                {
+                    for (int i = 0 ; i < DFB_TILE_SIZE ; i++)
+                    {
+                        tile[i] = (uint8_t) usb_getbyte_blocking();
+                    }
+                    if (t < DFB_NR_TILES)
+                    {
+                        set_vram_span(buffer_nr, t * DFB_TILE_SIZE, tile, DFB_TILE_SIZE);
+                    }
+                }
+                /* As with DAZ_CTRL, buffers are only switched while the Dazzler is on */
+                if ((c & DFB_COMMIT) && (dazzler_ctrl & DC_ON))
+                {
+                    /* Tiles not sent were drawn in the old mode if the mode changed since the buffer was last refreshed */
+                    if (frame_picture_ctrl[buffer_nr] != dazzler_picture_ctrl)
+                    {
+                        refresh_vram(buffer_nr);
+                    }
+                    /* Keep the control register in step so a later DAZ_CTRL is compared correctly */
+                    dazzler_ctrl = (dazzler_ctrl & ~0x01) | buffer_nr;
+                    set_active_framebuffer(buffer_nr);
+                }
+                break;
+            }
             case DAZ_FULLFRAME:
             {
                 PRINT_INFO("DAZ_FULLFRAME\n");
@@ -823,6 +1076,50 @@ void process_usb_commands()
                 }
                 break;
             }
+            case DAZ_DELTAFRAME:
+            {
+                /*
+                 * Same header bits as DAZ_FULLFRAME, but the frame is encoded relative to the
+                 * current raw_frame contents as a sequence of operations:
+                 * 0x00-0x7F: (op + 1) literal bytes follow
+                 * 0x80-0xBF: the next byte is repeated (op & 0x3F) + 1 times
+                 * 0xC0-0xFF: (op & 0x3F) + 1 bytes are unchanged
+                 * The packet ends once the whole 512 or 2048 bytes have been covered.
+                 */
+                PRINT_INFO("DAZ_DELTAFRAME\n");
+                if((c & 0x06) == 0)
+                {
+                    int buffer_nr  = (c & 0x08) ? 1 : 0;
+                    int count = (c & 0x01) ? 2048 : 512;
+                    int addr = 0;
+                    while (addr < count)
+                    {
+                        uint8_t op = (uint8_t) usb_getbyte_blocking();
+                        if (op < DELTA_REPEAT)
+                        {
+                            for (int run = op + 1 ; run > 0 ; run--, addr++)
+                            {
+                                uint8_t value = (uint8_t) usb_getbyte_blocking();
+                                if (addr < count)
+                                    set_vram(buffer_nr, addr, value, false);
+                            }
+                        }
+                        else if (op < DELTA_SKIP)
+                        {
+                            uint8_t value = (uint8_t) usb_getbyte_blocking();
+                            for (int run = (op & 0x3F) + 1 ; run > 0 && addr < count ; run--, addr++)
+                            {
+                                set_vram(buffer_nr, addr, value, false);
+                            }
+                        }
+                        else
+                        {
+                            addr += (op & 0x3F) + 1;
+                        }
+                    }
+                }
+                break;
+            }
             case DAZ_DAC:
             {
                 uint8_t channel = (c & 0x0f) == 0 ? 0: 1;
@@ -832,13 +1129,52 @@ void process_usb_commands()
                 PRINT_INFO("DAC: %d, %d, %x\n", channel, delay_us, sample);
                 break;
             }
+            case DAZ_DACBATCH:
+            {
+                /*
+                 * Same channel bit as DAZ_DAC, followed by the number of events - 1, then the delay and sample
+                 * of each event. Delays are the zigzag encoded difference from the previous delay in the packet
+                 * (starting from 0), in 1 or 2 bytes, or DDB_ABSOLUTE and the delay itself, low byte first.
+                 */
+                static uint16_t delays[256];
+                static uint8_t samples[256];
+                uint8_t channel = (c & 0x0f) == 0 ? 0: 1;
+                int count = (uint8_t) usb_getbyte_blocking() + 1;
+                uint16_t delay_us = 0;
+                for (int i = 0 ; i < count ; i++)
+                {
+                    uint8_t code = (uint8_t) usb_getbyte_blocking();
+                    if (code < DDB_ABSOLUTE)
+                    {
+                        uint16_t zigzag = code;
+                        if (code >= DDB_DELTA14)
+                        {
+                            zigzag = ((code & 0x3F) << 8) | (uint8_t) usb_getbyte_blocking();
+                        }
+                        delay_us += (zigzag >> 1) ^ -(zigzag & 1);
+                    }
+                    else
+                    {
+                        delay_us = (uint8_t) usb_getbyte_blocking();
+                        delay_us |= (uint8_t) usb_getbyte_blocking() << 8;
+                    }
+                    delays[i] = delay_us;
+                    samples[i] = (uint8_t) usb_getbyte_blocking();
+                }
+                audio_add_samples(channel, delays, samples, count);
+                PRINT_INFO("DAC batch: %d, %d\n", channel, count);
+                break;
+            }
         }
+        usb_flush_if_due();
     }
 }
 
 /* Start running video on core 1*/
 void core1_main()
 {
+    /* Allow core 0 to pause this core while it writes controller profiles to flash */
+    multicore_lockout_victim_init();
     setup_video();
     render_loop();
 }
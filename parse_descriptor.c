@@ -47,9 +47,9 @@ struct hid_input_button_skip
 
 /* Number of buttons in the HID descriptor to skip to find the buttons to map to 1/2/3/4.
  * If the pid of the controller is not listed here, the first 4 buttons found are used */
-struct hid_input_button_skip controller_skip_buttons[] = {0x0268, 12}; /* For PS3, skip first 12 buttons */
+struct hid_input_button_skip controller_skip_buttons[] = { { 0x0268, 12 } }; /* For PS3, skip first 12 buttons */
 
-#if 0 // Descriptors for testing the parser
+#ifdef PARSE_DESCRIPTOR_TEST // Descriptors for testing the parser
 const uint8_t snes_descriptor[] = {
     0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0xA1, 0x02, 0x75, 0x08, 0x95, 0x02, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x35, 0x00, 0x46, 
     0xFF, 0x00, 0x09, 0x30, 0x09, 0x31, 0x81, 0x02, 0x95, 0x03, 0x81, 0x01, 0x75, 0x01, 0x95, 0x04, 0x15, 0x00, 0x25, 0x01, 
@@ -69,8 +69,6 @@ const uint8_t ps3_descriptor[] = {
     0x95, 0x30, 0x09, 0x01, 0xB1, 0x02, 0xC0, 0xC0
 };
 
-#endif
-#if 0
 const uint8_t xbox_descriptor[] = {
     0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0xA1, 0x00, 0x09, 0x30, 0x09, 0x31, 0x15, 0x00, 0x27, 0xFF, 0xFF, 0x00, 0x00, 0x95, 0x02, 0x75, 0x10, 0x81, 0x02, 0xC0, 0xA1, 0x00, 0x09, 0x33, 0x09, 0x34, 
     0x15, 0x00, 0x27, 0xFF, 0xFF, 0x00, 0x00, 0x95, 0x02, 0x75, 0x10, 0x81, 0x02, 0xC0, 0x05, 0x01, 0x09, 0x32, 0x15, 0x00, 0x26, 0xFF, 0x03, 0x95, 0x01, 0x75, 0x0A, 0x81, 0x02, 0x15, 0x00, 0x25, 
@@ -83,151 +81,290 @@ const uint8_t xbox_descriptor[] = {
     0x08, 0x95, 0x01, 0x81, 0x02, 0xC0
 };
 
+const uint8_t minimal_xbox[] = {
+    0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0xA1, 0x02, 0x85, 0x20, 0x75, 0x08, 0x95, 0x03, 
+    0x06, 0x00, 0xFF, 0x81, 0x03, 0x75, 0x01, 0x95, 0x04, 0x06, 0x00, 0xFF, 0x81, 0x02, 
+    0x95, 0x0C, 0x15, 0x00, 0x25, 0x01, 0x05, 0x09, 0x81, 0x02, 0x75, 0x08, 0x95, 0x04, 
+    0x06, 0x00, 0xFF, 0x81, 0x03, 0xC0, 0xA1, 0x00, 0x75, 0x10, 0x95, 0x02, 0x15, 0x00, 
+    0x27, 0xFF, 0xFF, 0x00, 0x00, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x81, 0x03, 0xC0, 0xC0
+};
 
-typedef struct TU_ATTR_PACKED
-{
-  uint8_t  bLength;         /**< Numeric expression that is the total size of the HID descriptor */
-  uint8_t  bDescriptorType; /**< Constant name specifying type of HID descriptor. */
+/* Gamepad with only a hat switch for direction */
+const uint8_t hat_descriptor[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x15, 0x00, 0x25, 0x07, 0x35, 0x00, 0x46, 0x3B, 0x01, 0x65, 0x14, 0x75, 0x04, 0x95,
+    0x01, 0x09, 0x39, 0x81, 0x42, 0x65, 0x00, 0x81, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x04, 0x15, 0x00, 0x25, 0x01, 0x75,
+    0x01, 0x95, 0x04, 0x81, 0x02, 0x75, 0x04, 0x95, 0x01, 0x81, 0x01, 0xC0
+};
 
-  uint16_t bcdHID;          /**< Numeric expression identifying the HID Class Specification release */
-  uint8_t  bCountryCode;    /**< Numeric expression identifying country code of the localized hardware.  */
-  uint8_t  bNumDescriptors; /**< Numeric expression specifying the number of class descriptors */
+/* Gamepad with only a D-pad for direction */
+const uint8_t dpad_descriptor[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x03, 0x09, 0x90, 0x09, 0x91, 0x09, 0x92, 0x09, 0x93, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x04, 0x81, 0x02, 0x05, 0x09, 0x19, 0x01, 0x29, 0x04, 0x81, 0x02, 0xC0
+};
 
-  uint8_t  bReportType;     /**< Type of HID class report. */
-  uint16_t wReportLength;   /**< the total size of the Report descriptor. */
-} tusb_hid_descriptor_hid_t;
-#endif
+/* Composite gamepad with the axes, buttons and hat switch each in their own report */
+const uint8_t split_descriptor[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x01, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x02, 0x09, 0x30, 0x09,
+    0x31, 0x81, 0x02, 0x85, 0x02, 0x05, 0x09, 0x19, 0x01, 0x29, 0x08, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81,
+    0x02, 0x85, 0x03, 0x05, 0x01, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42, 0x75, 0x04, 0x95,
+    0x01, 0x81, 0x01, 0xC0
+};
 
-#if 0
-const uint8_t xbox_descriptor_1[] = {
-    0x09, 0x04, 0x00, 0x00, 0x02, 0xFF, 0x47, 0xD0, 0x00,
-    0x09, 0x21, 0x10, 0x01, 0x21, 0x01, 0x22, 0x2D, 0x01,
-    0x07, 0x05, 0x01, 0x03, 0x40, 0x00, 0x04,
-    0x07, 0x05, 0x81, 0x03, 0x40, 0x00, 0x04
+/* Report 2 has a Report Count of 0x08000002 32 bit fields, which wraps to 64 bits in 32 bit arithmetic */
+const uint8_t overflow_descriptor[] = {
+    0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0x85, 0x01, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x02, 0x09, 0x30, 0x09,
+    0x31, 0x81, 0x02, 0x05, 0x09, 0x19, 0x01, 0x29, 0x04, 0x25, 0x01, 0x75, 0x01, 0x95, 0x04, 0x81, 0x02, 0x95, 0x04, 0x81,
+    0x01, 0x85, 0x02, 0x75, 0x20, 0x97, 0x02, 0x00, 0x00, 0x08, 0x05, 0x01, 0x09, 0x30, 0x81, 0x02, 0xC0
 };
+#endif
 
-const int xbox_descriptor_size = sizeof(xbox_descriptor_full);
+/* Global items, saved and restored by Push and Pop */
+struct hid_globals
+{
+    uint16_t usage_page;
+    int32_t  logical_min;
+    int32_t  logical_max;
+    uint32_t report_size;
+    uint32_t report_count;
+    uint8_t  report_id;
+};
 
-const uint8_t minimal_xbox[] = {
-    0x05, 0x01, 0x09, 0x04, 0xA1, 0x01, 0xA1, 0x02, 0x85, 0x20, 0x75, 0x08, 0x95, 0x03, 
-    0x06, 0x00, 0xFF, 0x81, 0x03, 0x75, 0x01, 0x95, 0x04, 0x06, 0x00, 0xFF, 0x81, 0x02, 
-    0x95, 0x0C, 0x15, 0x00, 0x25, 0x01, 0x05, 0x09, 0x81, 0x02, 0x75, 0x08, 0x95, 0x04, 
-    0x06, 0x00, 0xFF, 0x81, 0x03, 0xC0, 0xA1, 0x00, 0x75, 0x10, 0x95, 0x02, 0x15, 0x00, 
-    0x27, 0xFF, 0xFF, 0x00, 0x00, 0x09, 0x30, 0x09, 0x31, 0x81, 0x03, 0xC0, 0xC0
+/* Local items, cleared after each main item */
+struct hid_locals
+{
+    uint32_t usages[HID_MAX_USAGES];    /* Extended usages, usage page in the upper 16 bits if given */
+    uint8_t  nr_usages;
+    uint32_t usage_min;
+    uint32_t usage_max;
+    uint8_t  has_usage_min;
+    uint8_t  has_usage_max;
 };
-#endif
 
-/*
- * This is a very minimal and very hacky HID descriptor parser. But hopefully it is good enough to
- * handle most controllers.
- * It looks for the first Usage (X) and assigns that and the next control to be the X/Y axes
- * And for the first 4 buttons and assigns them as buttons (by default).
- * Controller pid can be listed in hid_input_button_skip to configure which controller buttons are used.
- * Ignores collections and other structural elements.
- *
- * Reads the HID report descriptor and populates joystick_definition with the parsed configuration values
- */
-uint8_t parse_report_descriptor(uint16_t pid, uint8_t const *desc_report, uint16_t desc_len, struct joystick_bytes *joystick_definition)
+/* Return the usage of field index of a main item, with the usage page in the upper 16 bits */
+static uint32_t hid_field_usage(const struct hid_locals *locals, uint16_t usage_page, uint32_t index)
 {
-    union TU_ATTR_PACKED
+    uint32_t usage = 0;
+    if (locals->nr_usages > 0)
     {
-        uint8_t byte;
-        struct TU_ATTR_PACKED
-        {
-            uint8_t size : 2;
-            uint8_t type : 2;
-            uint8_t tag : 4;
-        };
-    } header;
-
-    int bit_counter = 0; /* How many bits into the report descriptor is the current input control */
+        /* The last usage applies to any remaining fields */
+        usage = locals->usages[(index < locals->nr_usages) ? index : (uint32_t) locals->nr_usages - 1];
+    }
+    else if (locals->has_usage_min)
+    {
+        usage = locals->usage_min + index;
+        if (locals->has_usage_max && usage > locals->usage_max)
+            usage = locals->usage_max;
+    }
+    if ((usage >> 16) == 0)
+        usage |= (uint32_t) usage_page << 16;
+    return usage;
+}
 
-    // uint8_t report_num = 0;
-    // uint8_t report_size = 0;
-    // uint8_t report_count = 0;
-    uint8_t nr_skip_buttons = 0;
-    memset(joystick_definition, 0, sizeof(struct joystick_bytes));
+/* Add the fields of an Input main item to the runs in map */
+static void hid_add_input(hid_report_map_t *map, const struct hid_globals *globals, const struct hid_locals *locals,
+                          uint32_t data, uint32_t bit_offset)
+{
+    bool has_usage = locals->nr_usages > 0 || locals->has_usage_min;
+    uint8_t flags = 0;
 
-    for (int i = 0; i < sizeof(controller_skip_buttons) / sizeof(struct hid_input_button_skip); i++)
+    if (data & 0x01)
     {
-        if (pid == controller_skip_buttons[i].pid)
+        /* Constant fields without a usage are padding */
+        if (!has_usage)
+            return;
+        flags |= HID_FIELD_CONSTANT;
+    }
+    if (!(data & 0x02))
+        flags |= HID_FIELD_ARRAY;
+    if (data & 0x40)
+        flags |= HID_FIELD_NULL;
+    if (globals->logical_min < 0)
+        flags |= HID_FIELD_SIGNED;
+
+    /* An array field holds the index of a usage from the list, so each field gets the first usage */
+    uint32_t count = (flags & HID_FIELD_ARRAY) ? 1 : globals->report_count;
+    hid_field_run_t *run = NULL;
+
+    for (uint32_t i = 0 ; i < count ; i++)
+    {
+        uint32_t usage = hid_field_usage(locals, globals->usage_page, i);
+
+        if (run != NULL)
         {
-            nr_skip_buttons = controller_skip_buttons[i].nr_skip;
+            uint32_t run_usage = ((uint32_t) run->usage_page << 16) | run->usage;
+            if (run->count == 1 && usage == run_usage)
+                run->flags |= HID_FIELD_ONE_USAGE;
+
+            if ((run->flags & HID_FIELD_ONE_USAGE) ? (usage == run_usage) : (usage == run_usage + run->count))
+            {
+                run->count++;
+                continue;
+            }
         }
+        if (map->nr_runs == HID_MAX_FIELD_RUNS)
+        {
+            map->truncated = 1;
+            return;
+        }
+        run = &map->runs[map->nr_runs++];
+        run->bit_offset = bit_offset + i * globals->report_size;
+        run->count = 1;
+        run->bit_size = globals->report_size;
+        run->report_id = globals->report_id;
+        run->flags = flags;
+        run->usage_page = usage >> 16;
+        run->usage = usage & 0xffff;
+        run->logical_min = globals->logical_min;
+        run->logical_max = globals->logical_max;
     }
+    if (flags & HID_FIELD_ARRAY)
+        run->count = globals->report_count;
+}
 
-    /* current parsed report count & size from descriptor */
-    uint8_t ri_report_count = 0;
-    uint8_t ri_report_size = 0;
-    uint8_t ri_report_usage = 0;
-    uint8_t ri_report_min = 0;
-    uint8_t ri_report_max = 0;
+/*
+ * Compile a HID report descriptor into the input fields of each report.
+ * Handles all short items, including usage minimum / maximum, extended usages, Push / Pop and
+ * multiple report ids, and skips long items. Output and feature reports are ignored.
+ * Fields that would end past HID_MAX_REPORT_LEN or are larger than 32 bits are not recorded.
+ * Returns false if the descriptor is malformed or has no input fields.
+ */
+bool hid_compile_report_descriptor(uint8_t const *desc_report, uint16_t desc_len, hid_report_map_t *map)
+{
+    struct hid_globals globals;
+    struct hid_globals global_stack[HID_MAX_GLOBAL_PUSH];
+    struct hid_locals locals;
+    int nr_pushed = 0;
+    int depth = 0;
+    uint32_t i = 0;
+
+    memset(map, 0, sizeof(hid_report_map_t));
+    memset(&globals, 0, sizeof(globals));
+    memset(&locals, 0, sizeof(locals));
+
+    while (i < desc_len)
+    {
+        uint8_t const header = desc_report[i++];
 
-    /* Skip the initial usage descriptor, it has already been checked */
-    desc_report += 4;
-    desc_len -= 4;
+        if (header == 0xFE)
+        {
+            /* Long item: data size, tag and then the data. None are defined, so skip them */
+            if (i + 2 > desc_len)
+                return false;
+            i += 2 + desc_report[i];
+            continue;
+        }
 
-    while (desc_len > 0)
-    {
-        header.byte = *desc_report++;
-        desc_len--;
+        uint8_t const tag = header >> 4;
+        uint8_t const type = (header >> 2) & 0x03;
+        uint8_t const size = (header & 0x03) == 3 ? 4 : (header & 0x03);
 
-        uint8_t const tag = header.tag;
-        uint8_t const type = header.type;
-        uint8_t const size = header.size;
+        if (i + size > desc_len)
+        {
+            PRINT_INFO("Report descriptor truncated at %lu\n", (unsigned long) i);
+            return false;
+        }
 
-        uint8_t const data8 = desc_report[0];
+        /* Item data is little endian, and signed for the items that can be negative */
+        uint32_t udata = 0;
+        for (int b = 0 ; b < size ; b++)
+            udata |= (uint32_t) desc_report[i + b] << (8 * b);
+        int32_t sdata = (size == 0 || size == 4) ? (int32_t) udata : (int32_t) (udata << (32 - 8 * size)) >> (32 - 8 * size);
+        i += size;
 
-        PRINT_TRACE("[%02X] tag = %d, type = %d, size = %d, data = ", header.byte, tag, type, size);
-        for (uint32_t i = 0; i < size; i++)
-            PRINT_TRACE("%02X ", desc_report[i]);
-        PRINT_TRACE("\r\n");
+        PRINT_TRACE("[%02X] tag = %d, type = %d, size = %d, data = %lx\r\n", header, tag, type, size, (unsigned long) udata);
 
         switch (type)
         {
-        case RI_TYPE_GLOBAL:
+        case RI_TYPE_MAIN:
         {
             switch (tag)
             {
-            case RI_GLOBAL_USAGE_PAGE:
+            case RI_MAIN_INPUT:
             {
-                if (data8 == HID_USAGE_PAGE_BUTTON)
+                /* Find how many bits into this report the fields start */
+                int r;
+                for (r = 0 ; r < map->nr_reports ; r++)
+                {
+                    if (map->reports[r].id == globals.report_id)
+                        break;
+                }
+                if (r == map->nr_reports)
+                {
+                    if (r == HID_MAX_REPORT_IDS)
+                    {
+                        map->truncated = 1;
+                        break;
+                    }
+                    map->reports[r].id = globals.report_id;
+                    map->reports[r].bits = globals.report_id ? 8 : 0;
+                    map->nr_reports++;
+                }
+
+                /* 64 bit so a huge report size or count can't wrap round to a short run */
+                uint32_t bit_offset = map->reports[r].bits;
+                uint64_t bits = (uint64_t) globals.report_size * globals.report_count;
+                if (bit_offset + bits > HID_MAX_REPORT_LEN * 8)
                 {
-                    PRINT_TRACE("Usage Button\n");
-                    ri_report_usage = HID_USAGE_PAGE_BUTTON;
+                    /* Can't be received, but keep the report length sane */
+                    map->truncated = 1;
+                    map->reports[r].bits = HID_MAX_REPORT_LEN * 8;
+                    break;
+                }
+                if (globals.report_size >= 1 && globals.report_size <= 32 && globals.report_count > 0)
+                {
+                    hid_add_input(map, &globals, &locals, udata, bit_offset);
                 }
+                map->reports[r].bits = bit_offset + (uint32_t) bits;
             }
             break;
-            case RI_GLOBAL_LOGICAL_MIN:
-            {
-                PRINT_TRACE("min = %d\r\n", data8);
-                ri_report_min = data8;
+            case RI_MAIN_COLLECTION:
+                depth++;
+                break;
+            case RI_MAIN_COLLECTION_END:
+                if (--depth < 0)
+                    return false;
+                break;
             }
-            break;
-            case RI_GLOBAL_LOGICAL_MAX:
-                /* Note: For 16 bit controllers, we still assume 8 bit      */
-                /* But this should still look at the most significant byte? */
-                PRINT_TRACE("max = %d, bits = %d\r\n", data8, ri_report_size);
-                ri_report_max = data8;
+            /* Every main item clears the local items */
+            memset(&locals, 0, sizeof(locals));
+        }
+        break;
+        case RI_TYPE_GLOBAL:
+        {
+            switch (tag)
+            {
+            case RI_GLOBAL_USAGE_PAGE:
+                globals.usage_page = udata;
                 break;
-            case RI_GLOBAL_REPORT_ID:
-                /* If ther is a report id, it will be the first byte of the report message */
-                if (!joystick_definition->has_report_id)
-                {
-                    joystick_definition->has_report_id = 1;
-                    joystick_definition->report_id = data8;
-                    PRINT_TRACE("Report Id: %d\n", data8);
-                }
-                bit_counter += 8;
+            case RI_GLOBAL_LOGICAL_MIN:
+                globals.logical_min = sdata;
+                break;
+            case RI_GLOBAL_LOGICAL_MAX:
+                /* Many descriptors give an unsigned maximum e.g. 0x25 0xFF for 255 when the minimum is 0 */
+                globals.logical_max = (globals.logical_min >= 0 && sdata < globals.logical_min) ? (int32_t) udata : sdata;
                 break;
             case RI_GLOBAL_REPORT_SIZE:
-                ri_report_size = data8;
-                PRINT_TRACE("Report Size = %d\n", data8);
+                globals.report_size = udata;
                 break;
-
             case RI_GLOBAL_REPORT_COUNT:
-                ri_report_count = data8;
-                PRINT_TRACE("Report Count = %d\n", data8);
+                globals.report_count = udata;
+                break;
+            case RI_GLOBAL_REPORT_ID:
+                /* If there is a report id, it will be the first byte of the report message */
+                if (udata == 0 || udata > 255)
+                    return false;
+                globals.report_id = udata;
+                map->has_report_id = 1;
+                break;
+            case RI_GLOBAL_PUSH:
+                if (nr_pushed == HID_MAX_GLOBAL_PUSH)
+                    return false;
+                global_stack[nr_pushed++] = globals;
+                break;
+            case RI_GLOBAL_POP:
+                if (nr_pushed == 0)
+                    return false;
+                globals = global_stack[--nr_pushed];
                 break;
             }
         }
@@ -237,135 +374,631 @@ uint8_t parse_report_descriptor(uint16_t pid, uint8_t const *desc_report, uint16
             switch (tag)
             {
             case RI_LOCAL_USAGE:
-            {
-                switch (data8)
-                {
-                case HID_USAGE_DESKTOP_X:
-                {
-                    PRINT_TRACE("Usage X\n");
-                    ri_report_usage = data8;
-                    break;
-                }
-                case HID_USAGE_DESKTOP_Y:
-                {
-                    PRINT_TRACE("Usage Y\n");
-                    break;
-                }
-                }
+                /* A 4 byte usage includes the usage page, otherwise the current page applies at the main item */
+                if (locals.nr_usages < HID_MAX_USAGES)
+                    locals.usages[locals.nr_usages++] = udata;
+                break;
+            case RI_LOCAL_USAGE_MIN:
+                locals.usage_min = udata;
+                locals.has_usage_min = 1;
+                break;
+            case RI_LOCAL_USAGE_MAX:
+                locals.usage_max = udata;
+                locals.has_usage_max = 1;
                 break;
-            }
             }
         }
         break;
-        case RI_TYPE_MAIN:
+        default:
+            /* Reserved item type */
+            return false;
+        }
+    }
+    PRINT_INFO("Compiled %d input field runs in %d reports%s\n", map->nr_runs, map->nr_reports,
+               map->truncated ? " (truncated)" : "");
+    return map->nr_runs > 0;
+}
+
+/*
+ * Build the extractor for field index of a run. A 4 byte read holds up to 32 - shift bits, so a field
+ * over 25 bits that does not start on a byte boundary can't be read. Returns false for those, with the
+ * extractor cleared so the field reads as 0.
+ */
+bool hid_make_extractor(const hid_field_run_t *run, uint16_t index, hid_extractor_t *extractor)
+{
+    uint32_t bit_offset = run->bit_offset + (uint32_t) index * run->bit_size;
+    uint8_t shift = bit_offset % 8;
+    uint8_t bit_size = run->bit_size;
+
+    if (shift + bit_size > 32)
+    {
+        memset(extractor, 0, sizeof(hid_extractor_t));
+        return false;
+    }
+
+    extractor->byte = bit_offset / 8;
+    extractor->shift = shift;
+    extractor->nbytes = (shift + bit_size + 7) / 8;
+    extractor->mask = (bit_size == 32) ? 0xffffffff : ((1u << bit_size) - 1);
+    extractor->sign_shift = (run->flags & HID_FIELD_SIGNED) ? 32 - bit_size : 0;
+    return true;
+}
+
+/*
+ * Return the index of the report in the joystick definition, adding it if it is new.
+ * Returns -1 if the definition already has HID_MAX_JOY_REPORTS reports.
+ */
+static int joystick_report(struct joystick_definition *joystick_definition, uint8_t report_id)
+{
+    for (int r = 0 ; r < joystick_definition->nr_reports ; r++)
+    {
+        if (joystick_definition->report_id[r] == report_id)
+            return r;
+    }
+    if (joystick_definition->nr_reports >= HID_MAX_JOY_REPORTS)
+        return -1;
+    joystick_definition->report_id[joystick_definition->nr_reports] = report_id;
+    return joystick_definition->nr_reports++;
+}
+
+/* Extend the length of a report of the joystick definition to cover the field */
+static void cover_field(struct joystick_definition *joystick_definition, int report, const hid_extractor_t *extractor)
+{
+    uint8_t end = extractor->byte + extractor->nbytes;
+    if (end > joystick_definition->report_len[report])
+        joystick_definition->report_len[report] = end;
+}
+
+/* Set the default HID buttons (numbered from 0) used for buttons 1 - 4, from controller_skip_buttons */
+void joystick_default_buttons(uint16_t pid, uint8_t button_map[4])
+{
+    uint8_t nr_skip_buttons = 0;
+
+    for (unsigned int i = 0; i < sizeof(controller_skip_buttons) / sizeof(struct hid_input_button_skip); i++)
+    {
+        if (pid == controller_skip_buttons[i].pid)
         {
-            switch (tag)
-            {
-            case RI_MAIN_INPUT:
+            nr_skip_buttons = controller_skip_buttons[i].nr_skip;
+        }
+    }
+    for (int b = 0 ; b < 4 ; b++)
+        button_map[b] = nr_skip_buttons + b;
+}
+
+/*
+ * Set the extractors for buttons 1 - 4 to the HID buttons in button_map.
+ * A button that is not in the report reads as not pressed. Returns the number of buttons mapped.
+ */
+uint8_t joystick_map_buttons(struct joystick_definition *joystick_definition, const uint8_t button_map[4])
+{
+    joystick_definition->nr_buttons = 0;
+    for (int b = 0 ; b < 4 ; b++)
+    {
+        hid_extractor_t *button = &joystick_definition->button[b];
+        memset(button, 0, sizeof(hid_extractor_t));
+        joystick_definition->button_report[b] = 0;
+        if (button_map[b] < joystick_definition->nr_hid_buttons)
+        {
+            uint16_t bit = joystick_definition->button_bits[button_map[b]] & JOY_BUTTON_BIT_MASK;
+            joystick_definition->button_report[b] = joystick_definition->button_bits[button_map[b]] >> JOY_BUTTON_REPORT_SHIFT;
+            button->byte = bit / 8;
+            button->shift = bit % 8;
+            button->nbytes = 1;
+            button->mask = 1;
+            joystick_definition->nr_buttons++;
+        }
+    }
+    return joystick_definition->nr_buttons;
+}
+
+/*
+ * Reads the HID report descriptor and populates joystick_definition with the extractors for the
+ * X and Y axes, hat switch, D-pad and the first 4 buttons (by default).
+ * Controller pid can be listed in hid_input_button_skip to configure which controller buttons are used.
+ * The first of each control is used whichever report it is in, so composite devices that split the
+ * axes and buttons across reports work. Up to HID_MAX_JOY_REPORTS reports are used.
+ */
+uint8_t parse_report_descriptor(uint16_t pid, uint8_t const *desc_report, uint16_t desc_len, struct joystick_definition *joystick_definition)
+{
+    /* Only used while a device is mounted, so keep it off the stack */
+    static hid_report_map_t map;
+    uint8_t button_map[4];
+
+    memset(joystick_definition, 0, sizeof(struct joystick_definition));
+
+    if (!hid_compile_report_descriptor(desc_report, desc_len, &map))
+    {
+        PRINT_INFO("Could not compile HID report descriptor\n");
+        return 0;
+    }
+    joystick_definition->has_report_id = map.has_report_id;
+
+    /* Find the first of each control, and the report it is in */
+    for (int r = 0 ; r < map.nr_runs ; r++)
+    {
+        const hid_field_run_t *run = &map.runs[r];
+
+        if (run->flags & HID_FIELD_ARRAY)
+            continue;
+
+        for (uint16_t n = 0 ; n < run->count ; n++)
+        {
+            uint16_t usage = (run->flags & HID_FIELD_ONE_USAGE) ? run->usage : run->usage + n;
+            hid_axis_t *axis = NULL;
+            hid_extractor_t *field = NULL;
+            int control = -1;
+            bool is_button = false;
+
+            if (run->usage_page == HID_USAGE_PAGE_DESKTOP)
             {
-                /* Input tag triggers registration of sticks / buttons */
-                for (int i = 0; i < ri_report_count; i++)
+                switch (usage)
                 {
-                    PRINT_TRACE("Input: Byte[%d:%d]\n", bit_counter / 8, bit_counter % 8);
-                    if (ri_report_usage == HID_USAGE_PAGE_BUTTON &&
-                        ri_report_size == 1 &&
-                        data8 == 0x02) /* Data input */
-                    {
-                        if (nr_skip_buttons > 0)
-                        {
-                            PRINT_TRACE("Skipping Button\n");
-                            nr_skip_buttons--;
-                            bit_counter += ri_report_size;
-                            continue;
-                        }
-                        uint8_t mask = 1 << (bit_counter % 8);
-                        if (!joystick_definition->b1_set)
-                        {
-                            joystick_definition->buttons_byte = bit_counter / 8;
-                            joystick_definition->b1_mask = mask;
-                            joystick_definition->b1_set = 1;
-                        }
-                        else if (!joystick_definition->b2_set)
-                        {
-                            joystick_definition->b2_mask = mask;
-                            joystick_definition->b2_set = 1;
-                        }
-                        else if (!joystick_definition->b3_set)
-                        {
-                            joystick_definition->b3_mask = mask;
-                            joystick_definition->b3_set = 1;
-                        }
-                        else if (!joystick_definition->b4_set)
-                        {
-                            joystick_definition->b4_mask = mask;
-                            joystick_definition->b4_set = 1;
-                        }
-                    }
-                    else if (!joystick_definition->xy_set &&
-                             (ri_report_usage == HID_USAGE_DESKTOP_X ||
-                              ri_report_usage == HID_USAGE_DESKTOP_Y))
+                case HID_USAGE_DESKTOP_X:
+                    axis = &joystick_definition->x;
+                    control = JOY_CONTROL_X;
+                    break;
+                case HID_USAGE_DESKTOP_Y:
+                    axis = &joystick_definition->y;
+                    control = JOY_CONTROL_Y;
+                    break;
+                case HID_USAGE_DESKTOP_HAT_SWITCH:
+                    axis = &joystick_definition->hat;
+                    control = JOY_CONTROL_HAT;
+                    break;
+                case HID_USAGE_DESKTOP_DPAD_UP:
+                case HID_USAGE_DESKTOP_DPAD_DOWN:
+                case HID_USAGE_DESKTOP_DPAD_RIGHT:
+                case HID_USAGE_DESKTOP_DPAD_LEFT:
+                    /* The D-pad is read from the report with the first direction found */
+                    if (!joystick_definition->has_dpad ||
+                        joystick_definition->report_id[joystick_definition->control_report[JOY_CONTROL_DPAD]] == run->report_id)
                     {
-                        if (ri_report_min != 0 || ri_report_max != 255 || ri_report_size != 8)
-                        {
-                            PRINT_INFO("Joystick probably not supported: Min[0:%d], Max[255:%d], Size[8:%d]\n",
-                                       ri_report_min, ri_report_max, ri_report_size);
-                        }
-                        /* Assumes the Y follows the X and is 8 bit with a min/max of 255*/
-                        joystick_definition->x_axis_byte = bit_counter / 8;
-                        /* If 16 bit precision, then take the most significant byte as input value */
-                        if (ri_report_size == 16)
-                            joystick_definition->x_axis_byte += 1;  
-                        joystick_definition->y_axis_byte = joystick_definition->x_axis_byte + (ri_report_size / 8);
-                        joystick_definition->xy_set = 1;
+                        field = &joystick_definition->dpad[usage - HID_USAGE_DESKTOP_DPAD_UP];
+                        control = JOY_CONTROL_DPAD;
                     }
-                    bit_counter += ri_report_size;
+                    break;
                 }
-                break;
+                if (axis != NULL)
+                    field = &axis->field;
             }
+            else if (run->usage_page == HID_USAGE_PAGE_BUTTON && run->bit_size == 1 &&
+                     !(run->flags & HID_FIELD_CONSTANT) && joystick_definition->nr_hid_buttons < HID_MAX_BUTTONS)
+            {
+                is_button = true;
+            }
+
+            /* Found extractors have a non zero mask. Fields that can't be read are left unfound */
+            hid_extractor_t extractor;
+            if ((control < 0 && !is_button) || (field != NULL && field->mask) || !hid_make_extractor(run, n, &extractor))
+                continue;
+            int report = joystick_report(joystick_definition, run->report_id);
+            if (report < 0)
+                continue;
+
+            if (is_button)
+            {
+                joystick_definition->button_bits[joystick_definition->nr_hid_buttons++] =
+                    (extractor.byte * 8 + extractor.shift) | report << JOY_BUTTON_REPORT_SHIFT;
+                cover_field(joystick_definition, report, &extractor);
+                continue;
+            }
+
+            *field = extractor;
+            cover_field(joystick_definition, report, field);
+            joystick_definition->control_report[control] = report;
+            if (control == JOY_CONTROL_DPAD)
+                joystick_definition->has_dpad = 1;
+            if (axis != NULL)
+            {
+                axis->logical_min = run->logical_min;
+                axis->logical_max = run->logical_max;
+                axis->bits = run->bit_size;
             }
         }
-        break;
-        }
-        desc_report += size;
-        desc_len -= size;
     }
+    if (!joystick_definition->x.bits && !joystick_definition->hat.bits && !joystick_definition->has_dpad)
+    {
+        PRINT_INFO("No X axis, hat switch or D-pad found\n");
+        return 0;
+    }
+
+    joystick_default_buttons(pid, button_map);
+    joystick_map_buttons(joystick_definition, button_map);
+
     PRINT_INFO("JOYSTICK_DEFINITION\n");
-    if (joystick_definition->has_report_id)
+    for (int r = 0 ; r < joystick_definition->nr_reports ; r++)
     {
-        PRINT_INFO("report id: %d\n", joystick_definition->report_id);
+        PRINT_INFO("report %d: id %d, length %d\n", r, joystick_definition->has_report_id ? joystick_definition->report_id[r] : 0,
+                   joystick_definition->report_len[r]);
     }
-    PRINT_INFO("x offset: %d\n", joystick_definition->x_axis_byte);
-    PRINT_INFO("y offset: %d\n", joystick_definition->y_axis_byte);
-    PRINT_INFO("b offset: %d\n", joystick_definition->buttons_byte);
-    PRINT_INFO("b1 mask: %x\n", joystick_definition->b1_mask);
-    PRINT_INFO("b2 mask: %x\n", joystick_definition->b2_mask);
-    PRINT_INFO("b3 mask: %x\n", joystick_definition->b3_mask);
-    PRINT_INFO("b4 mask: %x\n", joystick_definition->b4_mask);
-
-    return joystick_definition->xy_set &&
-           joystick_definition->b1_set &&
-           joystick_definition->b2_set &&
-           joystick_definition->b3_set &&
-           joystick_definition->b4_set;
+    PRINT_INFO("x, y, hat, d-pad in reports %d %d %d %d\n", joystick_definition->control_report[JOY_CONTROL_X],
+               joystick_definition->control_report[JOY_CONTROL_Y], joystick_definition->control_report[JOY_CONTROL_HAT],
+               joystick_definition->control_report[JOY_CONTROL_DPAD]);
+    PRINT_INFO("x: byte %d bit %d, %d bits, range %ld to %ld\n", joystick_definition->x.field.byte, joystick_definition->x.field.shift,
+               joystick_definition->x.bits, (long) joystick_definition->x.logical_min, (long) joystick_definition->x.logical_max);
+    PRINT_INFO("y: byte %d bit %d, %d bits, range %ld to %ld\n", joystick_definition->y.field.byte, joystick_definition->y.field.shift,
+               joystick_definition->y.bits, (long) joystick_definition->y.logical_min, (long) joystick_definition->y.logical_max);
+    if (joystick_definition->hat.bits)
+    {
+        PRINT_INFO("hat: byte %d bit %d, %d bits, range %ld to %ld\n", joystick_definition->hat.field.byte, joystick_definition->hat.field.shift,
+                   joystick_definition->hat.bits, (long) joystick_definition->hat.logical_min, (long) joystick_definition->hat.logical_max);
+    }
+    for (int d = 0 ; d < 4 ; d++)
+    {
+        if (joystick_definition->dpad[d].mask)
+        {
+            PRINT_INFO("d-pad %d: byte %d bit %d\n", d, joystick_definition->dpad[d].byte, joystick_definition->dpad[d].shift);
+        }
+    }
+    PRINT_INFO("%d buttons\n", joystick_definition->nr_hid_buttons);
+    for (int b = 0 ; b < joystick_definition->nr_buttons ; b++)
+    {
+        PRINT_INFO("b%d: report %d byte %d bit %d\n", b + 1, joystick_definition->button_report[b],
+                   joystick_definition->button[b].byte, joystick_definition->button[b].shift);
+    }
+
+    return ((joystick_definition->x.bits && joystick_definition->y.bits) ||
+            joystick_definition->hat.bits || joystick_definition->has_dpad) &&
+           joystick_definition->nr_buttons == 4;
 }
 
-#if 0 // For testing the parser
+#ifdef PARSE_DESCRIPTOR_TEST
+/*
+ * Host test for the parser, fuzzes the compiler and benchmarks it against the descriptors above
+ *   cc -O2 -fsanitize=address,undefined -DPARSE_DESCRIPTOR_TEST -o parse_test parse_descriptor.c
+ *   ./parse_test [iterations]
+ */
+#include <stdlib.h>
+#include <time.h>
 
-void main()
+struct test_descriptor
 {
-    uint8_t val;
-    int16_t sval;
+    const char *name;
+    uint16_t pid;
+    const uint8_t *desc;
+    uint16_t len;
+    /* Expected positions, as found by the original parser: report id of the X axis (or hat switch or D-pad),
+     * most significant byte of X and Y, bit of each button. Then the bit of the hat switch and D-pad up, or -1 for none.
+     * Last the report id of the buttons */
+    int report_id;
+    int x_byte;
+    int y_byte;
+    int button_bit[4];
+    int hat_bit;
+    int dpad_bit;
+    int button_report_id;
+};
 
+static const struct test_descriptor corpus[] = {
+    { "SNES", 0, snes_descriptor, sizeof(snes_descriptor), -1, 0, 1, { 44, 45, 46, 47 }, -1, -1, -1 },
+    { "PS3", 0x0268, ps3_descriptor, sizeof(ps3_descriptor), 1, 6, 7, { 28, 29, 30, 31 }, -1, -1, 1 },
+    { "XBOX", 0, xbox_descriptor, sizeof(xbox_descriptor), -1, 1, 3, { 96, 97, 98, 99 }, 112, -1, -1 },
+    { "XBOX minimal", 0, minimal_xbox, sizeof(minimal_xbox), 0x20, 11, 13, { 36, 37, 38, 39 }, -1, -1, 0x20 },
+    { "Hat", 0, hat_descriptor, sizeof(hat_descriptor), -1, -1, -1, { 8, 9, 10, 11 }, 0, -1, -1 },
+    { "D-pad", 0, dpad_descriptor, sizeof(dpad_descriptor), 3, -1, -1, { 12, 13, 14, 15 }, -1, 8, 3 },
+    { "Split reports", 0, split_descriptor, sizeof(split_descriptor), 1, 1, 2, { 8, 9, 10, 11 }, 8, -1, 2 },
+    { "Count overflow", 0, overflow_descriptor, sizeof(overflow_descriptor), 1, 1, 2, { 24, 25, 26, 27 }, -1, -1, 1 },
+};
+#define NR_CORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
 
-    struct joystick_bytes def;
-    //parse_report_descriptor(0, snes_descriptor, sizeof(snes_descriptor), &def);
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Byte holding the most significant 8 bits of an axis */
+static int axis_msb_byte(const hid_axis_t *axis)
+{
+    return axis->bits ? (axis->field.byte * 8 + axis->field.shift + axis->bits - 8) / 8 : -1;
+}
 
-    //memset(&def, 0, sizeof(struct joystick_bytes));
-    //parse_report_descriptor(0x0268, ps3_descriptor, sizeof(ps3_descriptor), &def);
+/* Bit position of a field, or -1 if it was not found */
+static int field_bit(const hid_extractor_t *f)
+{
+    return f->mask ? f->byte * 8 + f->shift : -1;
+}
 
-//    memset(&def, 0, sizeof(struct joystick_bytes));
-//    parse_report_descriptor(xbox_descriptor, sizeof(xbox_descriptor), &def);
+/* Report id of a report of the joystick definition, or -1 if the device does not use report ids */
+static int def_report_id(const struct joystick_definition *def, int report)
+{
+    return def->has_report_id ? def->report_id[report] : -1;
+}
 
-    parse_report_descriptor(0, minimal_xbox, sizeof(minimal_xbox), &def);
+static int check_expected(const struct test_descriptor *t)
+{
+    struct joystick_definition def;
+    int ok = parse_report_descriptor(t->pid, t->desc, t->len, &def);
+    int control = def.x.bits ? JOY_CONTROL_X : def.hat.bits ? JOY_CONTROL_HAT : JOY_CONTROL_DPAD;
+    int report = def.control_report[control];
+    int report_id = def_report_id(&def, report);
+
+    ok = ok && report_id == t->report_id && axis_msb_byte(&def.x) == t->x_byte && axis_msb_byte(&def.y) == t->y_byte;
+    for (int b = 0 ; b < 4 ; b++)
+    {
+        ok = ok && field_bit(&def.button[b]) == t->button_bit[b] && def.button[b].nbytes == 1 &&
+             def_report_id(&def, def.button_report[b]) == t->button_report_id;
+    }
+    ok = ok && field_bit(&def.hat.field) == t->hat_bit && field_bit(&def.dpad[0]) == t->dpad_bit;
+    printf("%-14s %s: report %d, %d bytes, x byte %d (%d bits), y byte %d (%d bits), buttons at bits %d %d %d %d (report %d), hat %d, d-pad %d\n",
+           t->name, ok ? "ok  " : "FAIL", report_id, def.report_len[report], def.x.field.byte, def.x.bits, def.y.field.byte, def.y.bits,
+           field_bit(&def.button[0]), field_bit(&def.button[1]), field_bit(&def.button[2]), field_bit(&def.button[3]),
+           def_report_id(&def, def.button_report[0]), field_bit(&def.hat.field), field_bit(&def.dpad[0]));
+    return ok;
 }
-#endif
\ No newline at end of file
+
+/* Check the compiled fields all lie inside their report, and can be read from a maximum length report */
+static int check_map(const hid_report_map_t *map, const uint8_t *report)
+{
+    volatile int32_t sink;
+
+    if (map->nr_runs > HID_MAX_FIELD_RUNS || map->nr_reports > HID_MAX_REPORT_IDS)
+        return 0;
+    for (int r = 0 ; r < map->nr_runs ; r++)
+    {
+        const hid_field_run_t *run = &map->runs[r];
+        int found = 0;
+
+        if (run->bit_size < 1 || run->bit_size > 32 || run->count == 0)
+            return 0;
+        for (int i = 0 ; i < map->nr_reports ; i++)
+        {
+            if (map->reports[i].id == run->report_id)
+            {
+                found = 1;
+                if (run->bit_offset + (uint32_t) run->count * run->bit_size > map->reports[i].bits ||
+                    map->reports[i].bits > HID_MAX_REPORT_LEN * 8)
+                    return 0;
+            }
+        }
+        if (!found)
+            return 0;
+        for (uint16_t n = 0 ; n < run->count ; n++)
+        {
+            hid_extractor_t f;
+            bool readable = hid_make_extractor(run, n, &f);
+            if (readable != ((run->bit_offset + n * run->bit_size) % 8 + run->bit_size <= 32))
+                return 0;
+            if (readable && (f.byte + f.nbytes > HID_MAX_REPORT_LEN || f.nbytes < 1 || f.nbytes > 4))
+                return 0;
+            sink = hid_extract(&f, report);
+            (void) sink;
+        }
+    }
+    return 1;
+}
+
+/* Check each control lies inside the report it is read from */
+static int check_definition(const struct joystick_definition *def)
+{
+    const hid_extractor_t *fields[] = { &def->x.field, &def->y.field, &def->hat.field,
+                                        &def->dpad[0], &def->dpad[1], &def->dpad[2], &def->dpad[3],
+                                        &def->button[0], &def->button[1], &def->button[2], &def->button[3] };
+    const uint8_t reports[] = { def->control_report[JOY_CONTROL_X], def->control_report[JOY_CONTROL_Y], def->control_report[JOY_CONTROL_HAT],
+                                def->control_report[JOY_CONTROL_DPAD], def->control_report[JOY_CONTROL_DPAD],
+                                def->control_report[JOY_CONTROL_DPAD], def->control_report[JOY_CONTROL_DPAD],
+                                def->button_report[0], def->button_report[1], def->button_report[2], def->button_report[3] };
+    if (def->nr_reports > HID_MAX_JOY_REPORTS)
+        return 0;
+    for (int r = 0 ; r < def->nr_reports ; r++)
+    {
+        if (def->report_len[r] > HID_MAX_REPORT_LEN)
+            return 0;
+    }
+    for (unsigned int i = 0 ; i < sizeof(fields) / sizeof(fields[0]) ; i++)
+    {
+        if (fields[i]->nbytes && (reports[i] >= def->nr_reports || fields[i]->byte + fields[i]->nbytes > def->report_len[reports[i]]))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Check table indexes for axes reporting values outside their logical range clamp to the end of
+ * the table, rather than wrapping round to full deflection the other way
+ */
+static int check_axis_range(void)
+{
+    static const struct { uint8_t flags; int32_t min; int32_t max; int32_t value; uint8_t index; } cases[] = {
+        { 0, 0, 1023, 0, 0 }, { 0, 0, 1023, 1023, 255 }, { 0, 0, 1023, 1024, 255 }, { 0, 0, 1023, 0xffff, 255 },
+        { 0, 100, 1123, 99, 0 }, { 0, 100, 1123, 612, 128 },
+        { HID_FIELD_SIGNED, -512, 511, -512, 0 }, { HID_FIELD_SIGNED, -512, 511, -513, 0 }, { HID_FIELD_SIGNED, -512, 511, 0, 128 },
+        { HID_FIELD_SIGNED, -512, 511, 511, 255 }, { HID_FIELD_SIGNED, -512, 511, 512, 255 }, { HID_FIELD_SIGNED, -512, 511, -32768, 0 },
+    };
+    int ok = 1;
+
+    for (unsigned int i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++)
+    {
+        /* A 16 bit axis at byte 1, with the table scaled as usb_joystick.c does */
+        hid_field_run_t run = { 8, 1, 16, 0, cases[i].flags, HID_USAGE_PAGE_DESKTOP, HID_USAGE_DESKTOP_X, cases[i].min, cases[i].max };
+        uint8_t report[HID_MAX_REPORT_LEN] = { 0, (uint8_t) cases[i].value, (uint8_t) (cases[i].value >> 8) };
+        hid_extractor_t f;
+        uint8_t shift = 0;
+
+        hid_make_extractor(&run, 0, &f);
+        while ((((int64_t) cases[i].max - cases[i].min) >> shift) > 255)
+            shift++;
+        uint8_t index = hid_table_index(hid_extract(&f, report), cases[i].min, shift);
+        if (index != cases[i].index)
+        {
+            printf("FAIL: axis %ld to %ld, value %ld gave index %d, expected %d\n", (long) cases[i].min, (long) cases[i].max,
+                   (long) cases[i].value, index, cases[i].index);
+            ok = 0;
+        }
+    }
+    printf("Axis range     %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+/* Check wide fields are read in full when aligned, and rejected rather than truncated when they are not */
+static int check_wide_fields(void)
+{
+    static const struct { uint16_t bit_offset; uint8_t bit_size; uint8_t flags; bool readable; int32_t value; } cases[] = {
+        { 8, 32, HID_FIELD_SIGNED, true, -2 }, { 8, 32, 0, true, 0x7ffffffe }, { 12, 28, HID_FIELD_SIGNED, true, -5 },
+        { 9, 25, HID_FIELD_SIGNED, true, -16777215 }, { 9, 26, HID_FIELD_SIGNED, true, -33554431 }, { 15, 26, 0, false, 0 }, { 12, 32, 0, false, 0 },
+        { 15, 30, HID_FIELD_SIGNED, false, 0 },
+    };
+    int ok = 1;
+
+    for (unsigned int i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++)
+    {
+        hid_field_run_t run = { cases[i].bit_offset, 1, cases[i].bit_size, 0, cases[i].flags, HID_USAGE_PAGE_DESKTOP,
+                                HID_USAGE_DESKTOP_X, 0, 0 };
+        uint8_t report[HID_MAX_REPORT_LEN] = { 0 };
+        uint64_t raw = ((uint64_t) (uint32_t) cases[i].value & ((1ull << cases[i].bit_size) - 1)) << (cases[i].bit_offset % 8);
+        for (int b = 0 ; b < 5 ; b++)
+            report[cases[i].bit_offset / 8 + b] = raw >> (8 * b);
+        /* Set the bits either side of the field, which must not be read */
+        report[cases[i].bit_offset / 8] |= (1 << (cases[i].bit_offset % 8)) - 1;
+
+        hid_extractor_t f;
+        bool readable = hid_make_extractor(&run, 0, &f);
+        int32_t value = hid_extract(&f, report);
+        if (readable != cases[i].readable || value != cases[i].value)
+        {
+            printf("FAIL: %d bit field at bit %d read %ld (%s), expected %ld (%s)\n", cases[i].bit_size, cases[i].bit_offset,
+                   (long) value, readable ? "readable" : "rejected", (long) cases[i].value, cases[i].readable ? "readable" : "rejected");
+            ok = 0;
+        }
+    }
+    printf("Wide fields    %s\n", ok ? "ok" : "FAIL");
+    return ok;
+}
+
+/* Apply a few random edits to a descriptor */
+static uint16_t mutate(uint8_t *buf, uint16_t len, uint16_t max_len)
+{
+    int nr_edits = 1 + rng() % 8;
+    for (int e = 0 ; e < nr_edits && len > 0 ; e++)
+    {
+        uint16_t pos = rng() % len;
+        switch (rng() % 6)
+        {
+        case 0:     /* Flip a bit */
+            buf[pos] ^= 1 << (rng() % 8);
+            break;
+        case 1:     /* Random byte */
+            buf[pos] = rng();
+            break;
+        case 2:     /* Insert a byte */
+            if (len < max_len)
+            {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = rng();
+                len++;
+            }
+            break;
+        case 3:     /* Delete a byte */
+            memmove(buf + pos, buf + pos + 1, len - pos - 1);
+            len--;
+            break;
+        case 4:     /* Truncate */
+            len = pos;
+            break;
+        case 5:     /* Duplicate a run of bytes */
+        {
+            uint16_t n = 1 + rng() % 16;
+            if (pos + n <= len && len + n <= max_len)
+            {
+                memmove(buf + pos + n, buf + pos, len - pos);
+                len += n;
+            }
+        }
+        break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    static hid_report_map_t map;
+    static uint8_t buf[1024];
+    uint8_t report[HID_MAX_REPORT_LEN];
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+    int failed = 0;
+
+    for (unsigned int t = 0 ; t < NR_CORPUS ; t++)
+        failed |= !check_expected(&corpus[t]);
+    failed |= !check_axis_range();
+    failed |= !check_wide_fields();
+
+    /* Fuzz: mutated descriptors must never read outside the descriptor, and must give fields inside the report */
+    long compiled = 0, parsed = 0;
+    for (long it = 0 ; it < iterations ; it++)
+    {
+        const struct test_descriptor *t = &corpus[rng() % NR_CORPUS];
+        memcpy(buf, t->desc, t->len);
+        uint16_t len = mutate(buf, t->len, sizeof(buf));
+        for (unsigned int i = 0 ; i < sizeof(report) ; i++)
+            report[i] = rng();
+
+        /* Copy to an exact size allocation so the sanitizer catches reads past the end */
+        uint8_t *desc = malloc(len ? len : 1);
+        memcpy(desc, buf, len);
+        if (hid_compile_report_descriptor(desc, len, &map))
+        {
+            compiled++;
+            if (!check_map(&map, report))
+            {
+                printf("FAIL: bad field table on iteration %ld\n", it);
+                failed = 1;
+                free(desc);
+                break;
+            }
+        }
+        struct joystick_definition def;
+        if (parse_report_descriptor(t->pid, desc, len, &def))
+            parsed++;
+        if (!check_definition(&def))
+        {
+            printf("FAIL: bad joystick definition on iteration %ld\n", it);
+            failed = 1;
+            free(desc);
+            break;
+        }
+        free(desc);
+    }
+    printf("Fuzz: %ld descriptors, %ld compiled, %ld usable as joysticks\n", iterations, compiled, parsed);
+
+    /* Benchmark compiling each descriptor and decoding a report with the result */
+    for (unsigned int t = 0 ; t < NR_CORPUS ; t++)
+    {
+        struct joystick_definition def;
+        const int nr_compile = 20000;
+        const int nr_decode = 10000000;
+        volatile uint32_t sink = 0;
+
+        double start = now_ns();
+        for (int i = 0 ; i < nr_compile ; i++)
+            parse_report_descriptor(corpus[t].pid, corpus[t].desc, corpus[t].len, &def);
+        double compile_ns = (now_ns() - start) / nr_compile;
+
+        start = now_ns();
+        for (int i = 0 ; i < nr_decode ; i++)
+        {
+            report[i & 7] = i;
+            uint32_t state = hid_extract(&def.x.field, report) ^ hid_extract(&def.y.field, report) << 8;
+            state ^= hid_extract(&def.hat.field, report) << 4;
+            for (int b = 0 ; b < 4 ; b++)
+                state ^= hid_extract(&def.button[b], report) << (16 + b) ^ hid_extract(&def.dpad[b], report) << (20 + b);
+            sink += state;
+        }
+        double decode_ns = (now_ns() - start) / nr_decode;
+        printf("%-14s %4d byte descriptor: compile %6.0f ns, decode %5.1f ns per report\n",
+               corpus[t].name, corpus[t].len, compile_ns, decode_ns);
+    }
+    return failed;
+}
+#endif
@@ -25,31 +25,148 @@
 #ifndef _PARSE_DESCRIPTOR_H
 #define _PARSE_DESCRIPTOR_H
 #include <stdint.h>
+#include <stdbool.h>
+
+#define HID_MAX_REPORT_LEN  64      /* Longest input report, matches CFG_TUH_HID_EPIN_BUFSIZE */
+#define HID_MAX_FIELD_RUNS  32      /* Runs of input fields recorded per device */
+#define HID_MAX_REPORT_IDS  8       /* Input reports (report ids) tracked per device */
+#define HID_MAX_USAGES      16      /* Local usages kept for one main item */
+#define HID_MAX_GLOBAL_PUSH 4       /* Depth of the Push / Pop global item stack */
+#define HID_MAX_BUTTONS     24      /* Buttons recorded for a joystick, that can be mapped to buttons 1 - 4 */
+#define HID_MAX_JOY_REPORTS 4       /* Reports that the controls of a joystick can be spread across */
+
+/* hid_field_run_t flags */
+#define HID_FIELD_CONSTANT  0x01    /* Constant input that has usages, treated as data as some controllers use it for data */
+#define HID_FIELD_ARRAY     0x02    /* Array (selector) fields rather than variables */
+#define HID_FIELD_SIGNED    0x04    /* Logical minimum is negative, values are sign extended */
+#define HID_FIELD_NULL      0x08    /* Fields have a null state e.g. a centred hat switch */
+#define HID_FIELD_ONE_USAGE 0x10    /* All fields in the run have the same usage */
+
+/*
+ * A run of input fields from one main item that have the same size and consecutive usages
+ * (or all the same usage). Field n of the run starts at bit_offset + n * bit_size and has
+ * usage usage + n, or usage if HID_FIELD_ONE_USAGE. Constant fields without usages are padding
+ * and are not recorded.
+ */
+typedef struct
+{
+    uint16_t bit_offset;            /* Of the first field, from the start of the report including the report id */
+    uint16_t count;                 /* Number of fields */
+    uint8_t  bit_size;              /* Size of each field, 1 - 32 */
+    uint8_t  report_id;             /* 0 if the device does not use report ids */
+    uint8_t  flags;
+    uint16_t usage_page;
+    uint16_t usage;                 /* Usage of the first field */
+    int32_t  logical_min;
+    int32_t  logical_max;
+} hid_field_run_t;
+
+/*
+ * Input reports described by a HID report descriptor, compiled by hid_compile_report_descriptor()
+ */
+typedef struct
+{
+    uint8_t  has_report_id;         /* Reports start with a report id byte */
+    uint8_t  nr_reports;
+    uint8_t  nr_runs;
+    uint8_t  truncated;             /* Runs or reports were dropped as the tables were full */
+    struct
+    {
+        uint8_t  id;
+        uint16_t bits;              /* Length of the report including the report id */
+    } reports[HID_MAX_REPORT_IDS];
+    hid_field_run_t runs[HID_MAX_FIELD_RUNS];
+} hid_report_map_t;
+
+/*
+ * Precomputed extractor for one field of a report.
+ * The field is in bytes [byte, byte + nbytes) and is read with hid_extract()
+ */
+typedef struct
+{
+    uint8_t  byte;                  /* First byte of the field */
+    uint8_t  shift;                 /* Bit position of the field in that byte */
+    uint8_t  nbytes;                /* Bytes the field covers, 1 - 4 */
+    uint8_t  sign_shift;            /* 32 - field size if the field is signed, otherwise 0 */
+    uint32_t mask;                  /* Mask for the field size */
+} hid_extractor_t;
+
+/* An axis: the extractor for the field and the range it reports */
+typedef struct
+{
+    hid_extractor_t field;
+    int32_t         logical_min;
+    int32_t         logical_max;
+    uint8_t         bits;           /* Field size, 0 if the axis was not found */
+} hid_axis_t;
+
+/* Controls that are each read from one report, indexes of control_report in joystick_definition */
+#define JOY_CONTROL_X       0
+#define JOY_CONTROL_Y       1
+#define JOY_CONTROL_HAT     2
+#define JOY_CONTROL_DPAD    3       /* All four D-pad directions are read from the same report */
+#define JOY_NR_CONTROLS     4
+
+/* button_bits holds the bit position of the button in the low bits, and the index of its report above them */
+#define JOY_BUTTON_BIT_MASK     0x0fff
+#define JOY_BUTTON_REPORT_SHIFT 12
 
 /* 
  * Joystick definition for reading a HID Report
- * Contains the byte offsets and bitmasks used to parse a HID report
- * and extract the x/y controls and button presses
+ * Contains the extractors used to read the x/y controls and button presses from HID reports.
+ * Composite devices can split the controls across reports, so each control records the index of
+ * the report it is read from. Controls that are not found have a zero extractor, which reads as 0
  */
-struct joystick_bytes
+struct joystick_definition
 {
-    uint8_t report_id; 
-    int     has_report_id;
-    int     x_axis_byte;
-    int     y_axis_byte;
-    int     buttons_byte;
-    uint8_t b1_mask;
-    uint8_t b2_mask;
-    uint8_t b3_mask;
-    uint8_t b4_mask;
-    /* TODO: bool */
-    uint8_t xy_set;
-    uint8_t b1_set;
-    uint8_t b2_set;
-    uint8_t b3_set;
-    uint8_t b4_set;
+    uint8_t         has_report_id;
+    uint8_t         nr_reports;     /* Reports that hold controls, 1 if the device does not use report ids */
+    uint8_t         report_id[HID_MAX_JOY_REPORTS];     /* Report id of each report, if has_report_id */
+    uint8_t         report_len[HID_MAX_JOY_REPORTS];    /* Shortest report that holds all of the controls in it */
+    uint8_t         control_report[JOY_NR_CONTROLS];    /* Report index of the X, Y, hat switch and D-pad */
+    uint8_t         button_report[4];                   /* Report index of buttons 1 - 4 */
+    uint8_t         nr_buttons;     /* Number of buttons mapped, up to 4 */
+    uint8_t         nr_hid_buttons; /* Number of buttons in the report, up to HID_MAX_BUTTONS */
+    uint8_t         has_dpad;
+    hid_axis_t      x;
+    hid_axis_t      y;
+    hid_axis_t      hat;            /* Hat switch */
+    hid_extractor_t dpad[4];        /* D-pad up, down, right, left. Missing controls have a mask of 0 */
+    hid_extractor_t button[4];      /* Buttons 1 - 4, mapped from the HID buttons */
+    uint16_t        button_bits[HID_MAX_BUTTONS];   /* Bit position and report index of each HID button */
 };
 
-uint8_t parse_report_descriptor(uint16_t pid, uint8_t const* desc_report, uint16_t desc_len, struct joystick_bytes *joystick_definition);
+/*
+ * Read a field from a report. Reads the same number of bytes and does the same operations
+ * whatever the field, so a report is decoded in constant time.
+ * The report must be at least as long as the report length found by the compiler.
+ */
+static inline int32_t hid_extract(const hid_extractor_t *f, const uint8_t *report)
+{
+    const uint8_t *p = report + f->byte;
+    uint32_t raw = p[0];
+    if (f->nbytes > 1) raw |= (uint32_t) p[1] << 8;
+    if (f->nbytes > 2) raw |= (uint32_t) p[2] << 16;
+    if (f->nbytes > 3) raw |= (uint32_t) p[3] << 24;
+    raw = (raw >> f->shift) & f->mask;
+    return (int32_t) (raw << f->sign_shift) >> f->sign_shift;
+}
+
+/*
+ * Index into a 256 entry table for a value read from a report, where entry i covers raw values from
+ * base + (i << shift). Controllers often overshoot their logical range by a count or two, so values
+ * outside the table are clamped to the first or last entry rather than wrapping round to the other end.
+ */
+static inline uint8_t hid_table_index(int32_t value, int32_t base, uint8_t shift)
+{
+    int64_t index = ((int64_t) value - base) >> shift;
+    return (index < 0) ? 0 : (index > 255) ? 255 : (uint8_t) index;
+}
+
+bool hid_compile_report_descriptor(uint8_t const *desc_report, uint16_t desc_len, hid_report_map_t *map);
+bool hid_make_extractor(const hid_field_run_t *run, uint16_t index, hid_extractor_t *extractor);
+void joystick_default_buttons(uint16_t pid, uint8_t button_map[4]);
+uint8_t joystick_map_buttons(struct joystick_definition *joystick_definition, const uint8_t button_map[4]);
+uint8_t parse_report_descriptor(uint16_t pid, uint8_t const* desc_report, uint16_t desc_len, struct joystick_definition *joystick_definition);
 
-#endif
\ No newline at end of file
+#endif
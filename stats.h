@@ -0,0 +1,46 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/*
+ * Runtime statistics.
+ * Set DAZ_STATS=1 in CMakeLists.txt to collect the counters and print them to the
+ * debug serial port every STATS_PERIOD_MS. With DAZ_STATS=0 the macros compile to nothing.
+ */
+#define STATS_PERIOD_MS     5000
+
+#if     DAZ_STATS > 0
+#define STATS_INC(counter)          { (counter)++; }
+#define STATS_ADD(counter, value)   { (counter) += (value); }
+#define STATS_MAX(gauge, value)     { if ((value) > (gauge)) (gauge) = (value); }
+#define STATS_SET(gauge, value)     { (gauge) = (value); }
+#else
+#define STATS_INC(counter)          {}
+#define STATS_ADD(counter, value)   {}
+#define STATS_MAX(gauge, value)     {}
+#define STATS_SET(gauge, value)     {}
+#endif
+
+#endif
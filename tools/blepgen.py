@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+#
+# MIT License
+#
+# Copyright (c) 2023 Paul Hatchman
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Generates the minimum phase band-limited step (minBLEP) residual table in daz_audio_render.c
+# A Blackman windowed sinc is made minimum phase with the real cepstrum, integrated into a step
+# and sampled at BLEP_PHASES sub-sample offsets. Each entry is the step minus the naive step, in Q14.
+#
+# Usage: python3 blepgen.py > table.txt
+
+import cmath
+import math
+
+TAPS = 8            # Output samples corrected after each transition
+PHASES = 16         # Sub-sample positions of a transition
+ZERO_CROSSINGS = 4  # Of the windowed sinc, either side of the centre
+CUTOFF = 0.9        # Fraction of Nyquist
+FFT_SIZE = 4096
+Q = 14
+
+def dft(x, inverse=False):
+    n = len(x)
+    if n == 1:
+        return list(x)
+    sign = 1 if inverse else -1
+    even = dft(x[0::2], inverse)
+    odd = dft(x[1::2], inverse)
+    out = [0] * n
+    for k in range(n // 2):
+        t = cmath.exp(sign * 2j * math.pi * k / n) * odd[k]
+        out[k] = even[k] + t
+        out[k + n // 2] = even[k] - t
+    return out
+
+def idft(x):
+    return [v / len(x) for v in dft(x, True)]
+
+# Band-limited impulse, oversampled by PHASES
+length = 2 * ZERO_CROSSINGS * PHASES + 1
+impulse = []
+for i in range(length):
+    t = (i - (length - 1) / 2) / PHASES
+    x = CUTOFF * t
+    sinc = 1.0 if x == 0 else math.sin(math.pi * x) / (math.pi * x)
+    window = 0.42 - 0.5 * math.cos(2 * math.pi * i / (length - 1)) + 0.08 * math.cos(4 * math.pi * i / (length - 1))
+    impulse.append(sinc * window)
+
+# Minimum phase version from the folded real cepstrum
+spectrum = dft(impulse + [0] * (FFT_SIZE - length))
+cepstrum = idft([math.log(max(abs(v), 1e-5)) for v in spectrum])
+folded = [cepstrum[0]] + [2 * c for c in cepstrum[1:FFT_SIZE // 2]] + [cepstrum[FFT_SIZE // 2]] + [0] * (FFT_SIZE // 2 - 1)
+min_phase = [v.real for v in idft([cmath.exp(v) for v in dft(folded)])]
+
+# Integrate into a step that reaches exactly 1 at the end of the table
+step = []
+total = 0
+for v in min_phase[:TAPS * PHASES]:
+    total += v
+    step.append(total)
+step = [v / total for v in step]
+
+def step_at(t):
+    """Band-limited step at t output samples after the transition"""
+    if t <= 0:
+        return 0.0
+    pos = t * PHASES - 1
+    if pos >= len(step) - 1:
+        return 1.0
+    if pos < 0:
+        return step[0] * (t * PHASES)
+    i = int(pos)
+    return step[i] + (step[i + 1] - step[i]) * (pos - i)
+
+# Transitions are rounded to the nearest output sample, so the true transition is -0.5 to +0.5 samples from it
+print("static const int16_t blep_residual[BLEP_PHASES][BLEP_TAPS] =")
+print("{")
+for p in range(PHASES):
+    offset = (p + 0.5) / PHASES - 0.5
+    row = [round((step_at(j + offset) - 1.0) * (1 << Q)) for j in range(TAPS)]
+    print("    { " + ", ".join("%6d" % v for v in row) + " },")
+print("};")
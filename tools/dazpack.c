@@ -0,0 +1,798 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*****************************************************************************
+ * DAZPACK
+ *
+ * Host side reference encoder / decoder for the extended Dazzler packets.
+ * Reads a capture of the raw byte stream sent by the Altair to the Dazzler,
+ * re-encodes it using the extended packet types and reports the bytes on the wire
+ * before and after. Every re-encoded packet is decoded again and checked against
+ * the original video ram contents.
+ *
+ * Build: cc -O2 -o dazpack dazpack.c
+ * Usage: dazpack [-d] [-m] [-f] [-a] capture.bin [output.bin]
+ *   -d  Encode DAZ_FULLFRAME packets as DAZ_DELTAFRAME where smaller
+ *   -m  Combine consecutive DAZ_MEMBYTE packets into DAZ_MEMRUN packets
+ *   -f  Encode DAZ_FULLFRAME + DAZ_CTRL buffer flips as DAZ_FRAMEBUF packets
+ *   -a  Combine DAZ_DAC packets for each channel into DAZ_DACBATCH packets
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Dazzler packet types (see main.c) */
+#define DAZ_MEMBYTE   0x10
+#define DAZ_FULLFRAME 0x20
+#define DAZ_CTRL      0x30
+#define DAZ_CTRLPIC   0x40
+#define DAZ_DAC       0x50
+#define DAZ_DELTAFRAME 0x60
+#define DAZ_MEMRUN    0x70
+#define DAZ_FRAMEBUF  0x80
+#define DAZ_DACBATCH  0x90
+#define DAZ_VERSION   0xF0
+
+/* DAZ_DELTAFRAME operation codes */
+#define DELTA_LITERAL 0x00
+#define DELTA_REPEAT  0x80
+#define DELTA_SKIP    0xC0
+#define DELTA_MAX_LITERAL 128
+#define DELTA_MAX_RUN     64
+
+/* Bitmasks for DAZ_CTRL */
+#define DC_ON           0x80
+
+/* Bitmasks and sizes for DAZ_FRAMEBUF */
+#define DFB_COMMIT      0x01
+#define DFB_TILE_SIZE   64
+#define DFB_NR_TILES    (2048 / DFB_TILE_SIZE)
+
+/* DAZ_DACBATCH delay codes */
+#define DDB_DELTA14   0x80
+#define DDB_ABSOLUTE  0xC0
+#define DACBATCH_MAX_US 2000    /* Most audio held back in a batch, below the firmware's minimum playout delay */
+
+/* Worst case encoded frame is all literals */
+#define DELTA_MAX_SIZE  (2048 + 2048 / DELTA_MAX_LITERAL + 1)
+
+static bool opt_delta = false;
+static bool opt_memrun = false;
+static bool opt_framebuf = false;
+static bool opt_dacbatch = false;
+
+/* Control register and displayed buffer, mirrors daz_ctrl() in main.c */
+static uint8_t dazzler_ctrl = 0x00;
+static int active_frame_buffer = 0;
+
+/* Picture control, and the picture control each buffer was last refreshed with by the firmware */
+static uint8_t dazzler_picture_ctrl = 0x00;
+static uint8_t frame_picture_ctrl[2];
+
+/* Buffer flips converted to DAZ_FRAMEBUF and the set_vram calls that saves in the firmware */
+static long framebuf_flips;
+static long framebuf_vram_saved;
+
+/* Copy of the Dazzler video ram as seen by the original and re-encoded streams */
+static uint8_t raw_frames[2][2048];
+
+/* Bytes on the wire per packet type, indexed by the high nibble */
+static long bytes_in[16];
+static long bytes_out[16];
+static long packets_in[16];
+static long packets_out[16];
+
+static const char *packet_names[16] = {
+    "0x00", "MEMBYTE", "FULLFRAME", "CTRL", "CTRLPIC", "DAC", "DELTAFRAME", "MEMRUN",
+    "FRAMEBUF", "DACBATCH", "0xA0", "0xB0", "0xC0", "0xD0", "0xE0", "VERSION"
+};
+
+static FILE *out_file;
+
+static void emit(const uint8_t *buf, int count)
+{
+    bytes_out[buf[0] >> 4] += count;
+    packets_out[buf[0] >> 4]++;
+    if (out_file)
+    {
+        fwrite(buf, 1, count, out_file);
+    }
+}
+
+/* Length of the packet starting at buf, or 0 if truncated */
+static int packet_length(const uint8_t *buf, long remaining)
+{
+    uint8_t c = buf[0];
+    int len = 1;
+    switch (c & 0xF0)
+    {
+        case DAZ_MEMBYTE:
+            len = 3;
+            break;
+        case DAZ_FULLFRAME:
+            if ((c & 0x06) == 0)
+                len = 1 + ((c & 0x01) ? 2048 : 512);
+            break;
+        case DAZ_CTRL:
+        case DAZ_CTRLPIC:
+            if ((c & 0x0F) == 0)
+                len = 2;
+            break;
+        case DAZ_DAC:
+            len = 4;
+            break;
+    }
+    return (len <= remaining) ? len : 0;
+}
+
+/*************************************************************
+ * DAZ_DELTAFRAME                                            *
+ *************************************************************/
+
+/* Number of bytes from pos that are unchanged from the previous frame */
+static int unchanged_run(const uint8_t *prev, const uint8_t *next, int pos, int count)
+{
+    int run = 0;
+    while (pos + run < count && prev[pos + run] == next[pos + run])
+        run++;
+    return run;
+}
+
+/* Number of bytes from pos that have the same value */
+static int repeat_run(const uint8_t *next, int pos, int count)
+{
+    int run = 1;
+    while (pos + run < count && next[pos + run] == next[pos])
+        run++;
+    return run;
+}
+
+/* Encode next relative to prev. Returns the encoded size, excluding the packet header */
+static int encode_deltaframe(const uint8_t *prev, const uint8_t *next, int count, uint8_t *out)
+{
+    int len = 0;
+    int pos = 0;
+    while (pos < count)
+    {
+        int skip = unchanged_run(prev, next, pos, count);
+        int repeat = repeat_run(next, pos, count);
+        if (skip > 0 && pos + skip == count)
+        {
+            /* Rest of the frame is unchanged */
+            while (skip > 0)
+            {
+                int run = (skip > DELTA_MAX_RUN) ? DELTA_MAX_RUN : skip;
+                out[len++] = DELTA_SKIP | (run - 1);
+                skip -= run;
+            }
+            break;
+        }
+        if (skip >= 2 || (skip == 1 && repeat < 3))
+        {
+            int run = (skip > DELTA_MAX_RUN) ? DELTA_MAX_RUN : skip;
+            out[len++] = DELTA_SKIP | (run - 1);
+            pos += run;
+        }
+        else if (repeat >= 3)
+        {
+            int run = (repeat > DELTA_MAX_RUN) ? DELTA_MAX_RUN : repeat;
+            out[len++] = DELTA_REPEAT | (run - 1);
+            out[len++] = next[pos];
+            pos += run;
+        }
+        else
+        {
+            /* Collect literals until a skip or repeat would be cheaper */
+            int start = pos;
+            int op = len++;
+            while (pos < count && pos - start < DELTA_MAX_LITERAL)
+            {
+                if (pos > start &&
+                    (unchanged_run(prev, next, pos, count) >= 2 || repeat_run(next, pos, count) >= 3))
+                    break;
+                out[len++] = next[pos++];
+            }
+            out[op] = DELTA_LITERAL | (pos - start - 1);
+        }
+    }
+    return len;
+}
+
+/* Reference decoder, mirrors the DAZ_DELTAFRAME handling in main.c.
+ * Returns the number of encoded bytes consumed or -1 if the data is truncated. */
+static int decode_deltaframe(uint8_t *frame, int count, const uint8_t *in, int in_len)
+{
+    int addr = 0;
+    int pos = 0;
+    while (addr < count)
+    {
+        if (pos >= in_len) return -1;
+        uint8_t op = in[pos++];
+        if (op < DELTA_REPEAT)
+        {
+            for (int run = op + 1 ; run > 0 ; run--, addr++)
+            {
+                if (pos >= in_len) return -1;
+                uint8_t value = in[pos++];
+                if (addr < count)
+                    frame[addr] = value;
+            }
+        }
+        else if (op < DELTA_SKIP)
+        {
+            if (pos >= in_len) return -1;
+            uint8_t value = in[pos++];
+            for (int run = (op & 0x3F) + 1 ; run > 0 && addr < count ; run--, addr++)
+                frame[addr] = value;
+        }
+        else
+        {
+            addr += (op & 0x3F) + 1;
+        }
+    }
+    return pos;
+}
+
+/*************************************************************
+ * DAZ_MEMRUN                                                *
+ *************************************************************/
+
+/* The run of DAZ_MEMBYTE packets collected so far */
+static struct
+{
+    int buffer_nr;
+    int addr;
+    int count;
+    uint8_t values[256];
+} memrun;
+
+/* Reference decoder, mirrors the DAZ_MEMRUN handling in main.c */
+static void decode_memrun(uint8_t frames[2][2048], const uint8_t *pkt)
+{
+    int buffer_nr = (pkt[0] & 0x08) ? 1 : 0;
+    int addr = (pkt[0] & 0x07) * 256 + pkt[1];
+    int count = pkt[2] + 1;
+    if (addr + count > 2048)
+        count = 2048 - addr;
+    memcpy(&frames[buffer_nr][addr], pkt + 3, count);
+}
+
+/* Send the collected run. A single byte is cheaper as a DAZ_MEMBYTE */
+static void flush_memrun(void)
+{
+    static uint8_t check[2][2048];
+    uint8_t out[3 + 256];
+    int addr = memrun.addr;
+
+    if (memrun.count == 0)
+        return;
+
+    if (memrun.count == 1)
+    {
+        out[0] = DAZ_MEMBYTE | (memrun.buffer_nr << 3) | (addr >> 8);
+        out[1] = addr & 0xFF;
+        out[2] = memrun.values[0];
+        emit(out, 3);
+    }
+    else
+    {
+        out[0] = DAZ_MEMRUN | (memrun.buffer_nr << 3) | (addr >> 8);
+        out[1] = addr & 0xFF;
+        out[2] = memrun.count - 1;
+        memcpy(out + 3, memrun.values, memrun.count);
+
+        memcpy(check, raw_frames, sizeof(check));
+        decode_memrun(check, out);
+        if (memcmp(&check[memrun.buffer_nr][addr], memrun.values, memrun.count) != 0)
+        {
+            fprintf(stderr, "DAZ_MEMRUN verification failed\n");
+            exit(1);
+        }
+        emit(out, 3 + memrun.count);
+    }
+    memcpy(&raw_frames[memrun.buffer_nr][addr], memrun.values, memrun.count);
+    memrun.count = 0;
+}
+
+/* Add a DAZ_MEMBYTE to the current run, starting a new run if it doesn't follow on */
+static void add_memrun(int buffer_nr, int addr, uint8_t value)
+{
+    if (memrun.count > 0 &&
+        (memrun.buffer_nr != buffer_nr ||
+         memrun.addr + memrun.count != addr ||
+         memrun.count == 256))
+    {
+        flush_memrun();
+    }
+    if (memrun.count == 0)
+    {
+        memrun.buffer_nr = buffer_nr;
+        memrun.addr = addr;
+    }
+    memrun.values[memrun.count++] = value;
+}
+
+static void process_fullframe(const uint8_t *pkt, int len)
+{
+    uint8_t c = pkt[0];
+    int buffer_nr = (c & 0x08) ? 1 : 0;
+    int count = len - 1;
+    uint8_t *frame = raw_frames[buffer_nr];
+
+    if (opt_delta)
+    {
+        static uint8_t out[1 + DELTA_MAX_SIZE];
+        static uint8_t check[2048];
+        int delta_len = encode_deltaframe(frame, pkt + 1, count, out + 1);
+        if (delta_len < count)
+        {
+            out[0] = DAZ_DELTAFRAME | (c & 0x0F);
+            memcpy(check, frame, count);
+            if (decode_deltaframe(check, count, out + 1, delta_len) != delta_len ||
+                memcmp(check, pkt + 1, count) != 0)
+            {
+                fprintf(stderr, "DAZ_DELTAFRAME verification failed\n");
+                exit(1);
+            }
+            emit(out, delta_len + 1);
+            memcpy(frame, pkt + 1, count);
+            return;
+        }
+    }
+    emit(pkt, len);
+    memcpy(frame, pkt + 1, count);
+}
+
+/*************************************************************
+ * DAZ_FRAMEBUF                                              *
+ *************************************************************/
+
+/* Apply a DAZ_CTRL packet to the control state */
+static void model_ctrl(const uint8_t *pkt, int len)
+{
+    if (len == 2)
+    {
+        uint8_t prev_dazzler_ctrl = dazzler_ctrl;
+        dazzler_ctrl = pkt[1];
+        if (dazzler_ctrl != prev_dazzler_ctrl && (dazzler_ctrl & DC_ON))
+        {
+            active_frame_buffer = dazzler_ctrl & 0x01;
+        }
+        /* The firmware redraws the buffer for a DAZ_CTRL */
+        frame_picture_ctrl[active_frame_buffer] = dazzler_picture_ctrl;
+    }
+}
+
+/* Apply a DAZ_CTRLPIC packet. A change of mode or colours redraws the displayed buffer */
+static void model_ctrlpic(const uint8_t *pkt, int len)
+{
+    if (len == 2 && pkt[1] != dazzler_picture_ctrl)
+    {
+        dazzler_picture_ctrl = pkt[1];
+        frame_picture_ctrl[active_frame_buffer] = dazzler_picture_ctrl;
+    }
+}
+
+/* Reference decoder, mirrors the DAZ_FRAMEBUF handling in main.c */
+static void decode_framebuf(uint8_t frames[2][2048], const uint8_t *pkt)
+{
+    int buffer_nr = active_frame_buffer ^ 1;
+    int first_tile = pkt[1];
+    int nr_tiles = pkt[2];
+    for (int t = first_tile ; t < first_tile + nr_tiles && t < DFB_NR_TILES ; t++)
+    {
+        memcpy(&frames[buffer_nr][t * DFB_TILE_SIZE], pkt + 3 + (t - first_tile) * DFB_TILE_SIZE, DFB_TILE_SIZE);
+    }
+}
+
+/*
+ * A full 2048 byte frame into the back buffer immediately followed by a DAZ_CTRL that
+ * only flips to that buffer becomes a single DAZ_FRAMEBUF with just the changed tiles.
+ * Returns false if the pair doesn't match that pattern.
+ */
+static bool process_frame_flip(const uint8_t *frame_pkt, int frame_len, const uint8_t *ctrl_pkt, int ctrl_len)
+{
+    static uint8_t out[3 + 2048];
+    static uint8_t check[2][2048];
+    int buffer_nr = (frame_pkt[0] & 0x08) ? 1 : 0;
+    uint8_t *frame = raw_frames[buffer_nr];
+    const uint8_t *next = frame_pkt + 1;
+
+    if (frame_len != 1 + 2048 || ctrl_len != 2 ||
+        buffer_nr != (active_frame_buffer ^ 1) ||
+        !(dazzler_ctrl & DC_ON) ||
+        ctrl_pkt[1] != ((dazzler_ctrl & ~0x01) | buffer_nr))
+    {
+        return false;
+    }
+
+    int first_tile = DFB_NR_TILES;
+    int last_tile = -1;
+    for (int t = 0 ; t < DFB_NR_TILES ; t++)
+    {
+        if (memcmp(&frame[t * DFB_TILE_SIZE], &next[t * DFB_TILE_SIZE], DFB_TILE_SIZE) != 0)
+        {
+            if (t < first_tile) first_tile = t;
+            last_tile = t;
+        }
+    }
+    int nr_tiles = (last_tile >= first_tile) ? last_tile - first_tile + 1 : 0;
+    if (nr_tiles == 0)
+    {
+        first_tile = 0;
+    }
+
+    out[0] = DAZ_FRAMEBUF | DFB_COMMIT;
+    out[1] = first_tile;
+    out[2] = nr_tiles;
+    memcpy(out + 3, &next[first_tile * DFB_TILE_SIZE], nr_tiles * DFB_TILE_SIZE);
+
+    memcpy(check, raw_frames, sizeof(check));
+    decode_framebuf(check, out);
+    if (memcmp(check[buffer_nr], next, 2048) != 0)
+    {
+        fprintf(stderr, "DAZ_FRAMEBUF verification failed\n");
+        exit(1);
+    }
+    emit(out, 3 + nr_tiles * DFB_TILE_SIZE);
+
+    bytes_in[frame_pkt[0] >> 4] += frame_len;
+    packets_in[frame_pkt[0] >> 4]++;
+    bytes_in[ctrl_pkt[0] >> 4] += ctrl_len;
+    packets_in[ctrl_pkt[0] >> 4]++;
+
+    /* The firmware no longer sets the unchanged tiles, or refreshes the whole buffer on the DAZ_CTRL,
+     * unless the mode changed since the buffer was last drawn */
+    framebuf_flips++;
+    framebuf_vram_saved += 2048 - nr_tiles * DFB_TILE_SIZE;
+    if (frame_picture_ctrl[buffer_nr] == dazzler_picture_ctrl)
+        framebuf_vram_saved += 2048;
+    frame_picture_ctrl[buffer_nr] = dazzler_picture_ctrl;
+
+    memcpy(frame, next, 2048);
+    dazzler_ctrl = ctrl_pkt[1];
+    active_frame_buffer = buffer_nr;
+    return true;
+}
+
+/*************************************************************
+ * DAZ_DACBATCH                                              *
+ *************************************************************/
+
+/* DAZ_DAC events collected for each channel */
+static struct
+{
+    int count;
+    uint32_t total_us;
+    uint16_t delays[256];
+    uint8_t samples[256];
+} dacbatch[2];
+
+/* Reference decoder, mirrors the DAZ_DACBATCH handling in main.c.
+ * Returns the number of events */
+static int decode_dacbatch(const uint8_t *pkt, uint16_t *delays, uint8_t *samples)
+{
+    int count = pkt[1] + 1;
+    int pos = 2;
+    uint16_t delay_us = 0;
+    for (int i = 0 ; i < count ; i++)
+    {
+        uint8_t code = pkt[pos++];
+        if (code < DDB_ABSOLUTE)
+        {
+            uint16_t zigzag = code;
+            if (code >= DDB_DELTA14)
+                zigzag = ((code & 0x3F) << 8) | pkt[pos++];
+            delay_us += (zigzag >> 1) ^ -(zigzag & 1);
+        }
+        else
+        {
+            delay_us = pkt[pos] | (pkt[pos + 1] << 8);
+            pos += 2;
+        }
+        delays[i] = delay_us;
+        samples[i] = pkt[pos++];
+    }
+    return count;
+}
+
+/* Encode events as a DAZ_DACBATCH packet. Returns the packet length */
+static int encode_dacbatch(int channel, const uint16_t *delays, const uint8_t *samples, int count, uint8_t *out)
+{
+    int len = 0;
+    uint16_t prev = 0;
+    out[len++] = DAZ_DACBATCH | channel;
+    out[len++] = count - 1;
+    for (int i = 0 ; i < count ; i++)
+    {
+        int32_t diff = (int16_t) (delays[i] - prev);
+        uint32_t zigzag = ((uint32_t) diff << 1) ^ (uint32_t) (diff >> 31);
+        if (zigzag < DDB_DELTA14)
+        {
+            out[len++] = zigzag;
+        }
+        else if (zigzag < 0x4000)
+        {
+            out[len++] = DDB_DELTA14 | (zigzag >> 8);
+            out[len++] = zigzag & 0xFF;
+        }
+        else
+        {
+            out[len++] = DDB_ABSOLUTE;
+            out[len++] = delays[i] & 0xFF;
+            out[len++] = delays[i] >> 8;
+        }
+        out[len++] = samples[i];
+        prev = delays[i];
+    }
+    return len;
+}
+
+/* Send the events collected for a channel. A single event is cheaper as a DAZ_DAC */
+static void flush_dacbatch(int channel)
+{
+    uint8_t out[2 + 256 * 4];
+    int count = dacbatch[channel].count;
+
+    if (count == 0)
+        return;
+
+    if (count == 1)
+    {
+        out[0] = DAZ_DAC | channel;
+        out[1] = dacbatch[channel].delays[0] & 0xFF;
+        out[2] = dacbatch[channel].delays[0] >> 8;
+        out[3] = dacbatch[channel].samples[0];
+        emit(out, 4);
+    }
+    else
+    {
+        static uint16_t check_delays[256];
+        static uint8_t check_samples[256];
+        int len = encode_dacbatch(channel, dacbatch[channel].delays, dacbatch[channel].samples, count, out);
+        if (decode_dacbatch(out, check_delays, check_samples) != count ||
+            memcmp(check_delays, dacbatch[channel].delays, count * sizeof(uint16_t)) != 0 ||
+            memcmp(check_samples, dacbatch[channel].samples, count) != 0)
+        {
+            fprintf(stderr, "DAZ_DACBATCH verification failed\n");
+            exit(1);
+        }
+        emit(out, len);
+    }
+    dacbatch[channel].count = 0;
+    dacbatch[channel].total_us = 0;
+}
+
+/* Add a DAZ_DAC event to its channel's batch. The batch is sent once it holds DACBATCH_MAX_US of audio,
+ * as the Altair would have to hold the events back for that long */
+static void add_dacbatch(int channel, uint16_t delay_us, uint8_t sample)
+{
+    int count = dacbatch[channel].count;
+    dacbatch[channel].delays[count] = delay_us;
+    dacbatch[channel].samples[count] = sample;
+    dacbatch[channel].count++;
+    dacbatch[channel].total_us += delay_us;
+    if (dacbatch[channel].count == 256 || dacbatch[channel].total_us >= DACBATCH_MAX_US)
+        flush_dacbatch(channel);
+}
+
+/* Process the packet at pkt. next is the following packet, or NULL at the end of the capture.
+ * Returns the number of bytes consumed */
+static int process_packet(const uint8_t *pkt, int len, const uint8_t *next, int next_len)
+{
+    uint8_t c = pkt[0];
+
+    /* Runs must be sent before any other packet to keep the stream in order */
+    if ((c & 0xF0) != DAZ_MEMBYTE)
+    {
+        flush_memrun();
+    }
+
+    /* Audio from the batches is sent before anything else, so it is not held back behind video */
+    if ((c & 0xF0) != DAZ_DAC)
+    {
+        flush_dacbatch(0);
+        flush_dacbatch(1);
+    }
+
+    if (opt_framebuf && (c & 0xF0) == DAZ_FULLFRAME && next && (next[0] & 0xF0) == DAZ_CTRL &&
+        process_frame_flip(pkt, len, next, next_len))
+    {
+        return len + next_len;
+    }
+
+    bytes_in[c >> 4] += len;
+    packets_in[c >> 4]++;
+
+    switch (c & 0xF0)
+    {
+        case DAZ_MEMBYTE:
+        {
+            int buffer_nr = (c & 0x08) ? 1 : 0;
+            int addr = (c & 0x07) * 256 + pkt[1];
+            if (opt_memrun)
+            {
+                /* raw_frames is updated when the run is sent */
+                add_memrun(buffer_nr, addr, pkt[2]);
+                break;
+            }
+            raw_frames[buffer_nr][addr] = pkt[2];
+            emit(pkt, len);
+            break;
+        }
+        case DAZ_FULLFRAME:
+            if (len > 1)
+            {
+                process_fullframe(pkt, len);
+                break;
+            }
+            emit(pkt, len);
+            break;
+        case DAZ_CTRL:
+            model_ctrl(pkt, len);
+            emit(pkt, len);
+            break;
+        case DAZ_CTRLPIC:
+            model_ctrlpic(pkt, len);
+            emit(pkt, len);
+            break;
+        case DAZ_DAC:
+            if (opt_dacbatch)
+            {
+                add_dacbatch((c & 0x0F) == 0 ? 0 : 1, pkt[1] | (pkt[2] << 8), pkt[3]);
+                break;
+            }
+            emit(pkt, len);
+            break;
+        default:
+            emit(pkt, len);
+            break;
+    }
+    return len;
+}
+
+static void print_results(void)
+{
+    long total_in = 0;
+    long total_out = 0;
+    printf("%-12s %10s %12s %10s %12s\n", "Packet", "In", "In bytes", "Out", "Out bytes");
+    for (int i = 0 ; i < 16 ; i++)
+    {
+        if (packets_in[i] || packets_out[i])
+        {
+            printf("%-12s %10ld %12ld %10ld %12ld\n", packet_names[i],
+                   packets_in[i], bytes_in[i], packets_out[i], bytes_out[i]);
+        }
+        total_in += bytes_in[i];
+        total_out += bytes_out[i];
+    }
+    printf("Total bytes: %ld -> %ld", total_in, total_out);
+    if (total_in)
+    {
+        printf(" (%.1f%% reduction)", 100.0 * (total_in - total_out) / total_in);
+    }
+    printf("\n");
+    if (opt_framebuf)
+    {
+        printf("Buffer flips as DAZ_FRAMEBUF: %ld, firmware set_vram calls saved: %ld\n",
+               framebuf_flips, framebuf_vram_saved);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: dazpack [-d] [-m] [-f] [-a] capture.bin [output.bin]\n");
+    fprintf(stderr, "  -d  Encode DAZ_FULLFRAME packets as DAZ_DELTAFRAME where smaller\n");
+    fprintf(stderr, "  -m  Combine consecutive DAZ_MEMBYTE packets into DAZ_MEMRUN packets\n");
+    fprintf(stderr, "  -f  Encode DAZ_FULLFRAME + DAZ_CTRL buffer flips as DAZ_FRAMEBUF packets\n");
+    fprintf(stderr, "  -a  Combine DAZ_DAC packets for each channel into DAZ_DACBATCH packets\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *in_name = NULL;
+    const char *out_name = NULL;
+
+    for (int i = 1 ; i < argc ; i++)
+    {
+        if (!strcmp(argv[i], "-d"))
+            opt_delta = true;
+        else if (!strcmp(argv[i], "-m"))
+            opt_memrun = true;
+        else if (!strcmp(argv[i], "-f"))
+            opt_framebuf = true;
+        else if (!strcmp(argv[i], "-a"))
+            opt_dacbatch = true;
+        else if (argv[i][0] == '-')
+            usage();
+        else if (!in_name)
+            in_name = argv[i];
+        else if (!out_name)
+            out_name = argv[i];
+        else
+            usage();
+    }
+    if (!in_name)
+        usage();
+
+    FILE *in_file = fopen(in_name, "rb");
+    if (!in_file)
+    {
+        perror(in_name);
+        return 1;
+    }
+    fseek(in_file, 0, SEEK_END);
+    long size = ftell(in_file);
+    fseek(in_file, 0, SEEK_SET);
+    uint8_t *capture = malloc(size ? size : 1);
+    if (!capture || fread(capture, 1, size, in_file) != (size_t) size)
+    {
+        fprintf(stderr, "Error reading %s\n", in_name);
+        return 1;
+    }
+    fclose(in_file);
+
+    if (out_name)
+    {
+        out_file = fopen(out_name, "wb");
+        if (!out_file)
+        {
+            perror(out_name);
+            return 1;
+        }
+    }
+
+    long pos = 0;
+    while (pos < size)
+    {
+        int len = packet_length(capture + pos, size - pos);
+        if (len == 0)
+        {
+            fprintf(stderr, "Capture truncated at offset %ld\n", pos);
+            break;
+        }
+        const uint8_t *next = NULL;
+        int next_len = 0;
+        if (pos + len < size)
+        {
+            next_len = packet_length(capture + pos + len, size - pos - len);
+            if (next_len)
+                next = capture + pos + len;
+        }
+        pos += process_packet(capture + pos, len, next, next_len);
+    }
+    flush_memrun();
+    flush_dacbatch(0);
+    flush_dacbatch(1);
+
+    print_results();
+    if (out_file)
+        fclose(out_file);
+    free(capture);
+    return 0;
+}
@@ -0,0 +1,544 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Paul Hatchman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*****************************************************************************
+ * DAZWAV
+ *
+ * Renders a list of Dazzler DAC events, or the DAZ_DAC (and DAZ_DACBATCH) packets in a capture of
+ * the Dazzler byte stream, to a 48kHz stereo WAV file using the firmware's
+ * renderer (daz_audio_render.c), so the output is exactly what the Pico plays
+ * and can be diffed between versions. Reports the render speed as a multiple
+ * of realtime.
+ *
+ * Build: cc -O2 -I.. -o dazwav dazwav.c ../daz_audio_render.c -lm
+ * Usage: dazwav [-n] events.txt output.wav
+ *        dazwav [-n] -c capture.bin output.wav
+ *        dazwav [-n] -t freq [output.wav]
+ *   -n  Render naive steps instead of band-limited steps
+ *   -c  Input is a capture of the bytes sent by the Altair to the Dazzler
+ *   -t  Render a SOUND.COM style square wave of freq Hz, report the renderer's
+ *       speed in ns per output sample and the energy aliased below Nyquist.
+ *       freq must divide 500000 so the half period is a whole number of us
+ *
+ * Each line of the event list is "channel delay_us sample", where delay_us is
+ * how long to play the previous sample on that channel and sample is the signed
+ * 8 bit DAC value (-128 to 127, or 0x00 to 0xff). Lines starting with # are ignored.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "daz_audio_render.h"
+
+#define BLOCK_FRAMES    96
+#define TONE_LEVEL      0x7f                    /* Square wave is +/- TONE_LEVEL */
+#define TONE_SETTLE     (AUDIO_RENDER_RATE / 10) /* Frames rendered before measuring aliasing */
+#define TONE_FRAMES     AUDIO_RENDER_RATE       /* Frames measured, for 1Hz bins */
+#define BENCH_SECONDS   60
+#define RENDER_CHUNK    64                      /* Blocks rendered between reading the clock */
+
+/* Dazzler packet types (see main.c) */
+#define DAZ_MEMBYTE     0x10
+#define DAZ_FULLFRAME   0x20
+#define DAZ_CTRL        0x30
+#define DAZ_CTRLPIC     0x40
+#define DAZ_DAC         0x50
+#define DAZ_DELTAFRAME  0x60
+#define DAZ_MEMRUN      0x70
+#define DAZ_FRAMEBUF    0x80
+#define DAZ_DACBATCH    0x90
+
+/* DAZ_DACBATCH delay codes */
+#define DDB_DELTA14     0x80
+#define DDB_ABSOLUTE    0xC0
+
+static bool opt_naive = false;
+
+typedef struct
+{
+    uint32_t *events;
+    int count;
+    int size;
+    int next;
+} event_list_t;
+
+static event_list_t event_lists[2];
+
+/* ctx is the event list for each channel */
+static bool pop_event(int channel, uint32_t *delay_and_sample, void *ctx)
+{
+    event_list_t *list = &((event_list_t *) ctx)[channel];
+    if (list->next == list->count)
+    {
+        return false;
+    }
+    *delay_and_sample = list->events[list->next++];
+    return true;
+}
+
+static void add_event(int channel, uint16_t delay_us, uint8_t sample)
+{
+    event_list_t *list = &event_lists[channel];
+    if (list->count == list->size)
+    {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->events = realloc(list->events, list->size * sizeof(uint32_t));
+        if (!list->events)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    /* Same conversion as audio_add_sample() */
+    list->events[list->count++] = (delay_us << 16) | (sample << 8);
+}
+
+static bool read_events(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        perror(filename);
+        return false;
+    }
+    char line[128];
+    int line_nr = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        line_nr++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+        {
+            continue;
+        }
+        char *end;
+        long channel = strtol(p, &end, 0);
+        long delay_us = strtol(end, &end, 0);
+        long sample = strtol(end, &end, 0);
+        if (channel < 0 || channel > 1 || delay_us < 0 || delay_us > 0xffff || sample < -128 || sample > 0xff)
+        {
+            fprintf(stderr, "%s:%d: bad event\n", filename, line_nr);
+            fclose(f);
+            return false;
+        }
+        add_event(channel, delay_us, sample & 0xff);
+    }
+    fclose(f);
+    return true;
+}
+
+/* Length of the packet starting at buf, or 0 if truncated */
+static long packet_length(const uint8_t *buf, long remaining)
+{
+    uint8_t c = buf[0];
+    long len = 1;
+    switch (c & 0xF0)
+    {
+        case DAZ_MEMBYTE:
+            len = 3;
+            break;
+        case DAZ_FULLFRAME:
+            if ((c & 0x06) == 0)
+                len = 1 + ((c & 0x01) ? 2048 : 512);
+            break;
+        case DAZ_CTRL:
+        case DAZ_CTRLPIC:
+            if ((c & 0x0F) == 0)
+                len = 2;
+            break;
+        case DAZ_DAC:
+            len = 4;
+            break;
+        case DAZ_DELTAFRAME:
+        {
+            /* Walk the operations until the frame is covered */
+            int count = (c & 0x01) ? 2048 : 512;
+            for (int covered = 0 ; covered < count ; )
+            {
+                if (len >= remaining)
+                    return 0;
+                uint8_t op = buf[len++];
+                if (op < 0x80)
+                {
+                    len += op + 1;
+                    covered += op + 1;
+                }
+                else
+                {
+                    len += (op < 0xC0) ? 1 : 0;
+                    covered += (op & 0x3F) + 1;
+                }
+            }
+            break;
+        }
+        case DAZ_MEMRUN:
+            len = (remaining >= 3) ? 3 + buf[2] + 1 : 3;
+            break;
+        case DAZ_FRAMEBUF:
+            len = (remaining >= 3) ? 3 + buf[2] * 64 : 3;
+            break;
+        case DAZ_DACBATCH:
+        {
+            int count = (remaining >= 2) ? buf[1] + 1 : 0;
+            len = 2;
+            for (int i = 0 ; i < count ; i++)
+            {
+                if (len >= remaining)
+                    return 0;
+                uint8_t code = buf[len];
+                len += (code < DDB_DELTA14) ? 2 : (code < DDB_ABSOLUTE) ? 3 : 4;
+            }
+            break;
+        }
+    }
+    return (len <= remaining) ? len : 0;
+}
+
+/* Collect the DAZ_DAC events from a capture of the Dazzler byte stream */
+static bool read_capture(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *capture = malloc(size ? size : 1);
+    if (!capture || fread(capture, 1, size, f) != (size_t) size)
+    {
+        fprintf(stderr, "Error reading %s\n", filename);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    long pos = 0;
+    while (pos < size)
+    {
+        long len = packet_length(capture + pos, size - pos);
+        if (len == 0)
+        {
+            fprintf(stderr, "Capture truncated at offset %ld\n", pos);
+            break;
+        }
+        const uint8_t *pkt = capture + pos;
+        int channel = (pkt[0] & 0x0f) == 0 ? 0 : 1;
+        if ((pkt[0] & 0xF0) == DAZ_DAC)
+        {
+            add_event(channel, pkt[1] | (pkt[2] << 8), pkt[3]);
+        }
+        else if ((pkt[0] & 0xF0) == DAZ_DACBATCH)
+        {
+            /* As in main.c, delays are zigzag encoded differences from the previous one, or absolute */
+            uint16_t delay_us = 0;
+            for (int i = 0, pos = 2 ; i < pkt[1] + 1 ; i++)
+            {
+                uint8_t code = pkt[pos++];
+                if (code < DDB_ABSOLUTE)
+                {
+                    uint16_t zigzag = code;
+                    if (code >= DDB_DELTA14)
+                        zigzag = ((code & 0x3F) << 8) | pkt[pos++];
+                    delay_us += (zigzag >> 1) ^ -(zigzag & 1);
+                }
+                else
+                {
+                    delay_us = pkt[pos] | (pkt[pos + 1] << 8);
+                    pos += 2;
+                }
+                add_event(channel, delay_us, pkt[pos++]);
+            }
+        }
+        pos += len;
+    }
+    free(capture);
+    return true;
+}
+
+static void put_le(uint8_t *p, uint32_t value, int bytes)
+{
+    for (int i = 0 ; i < bytes ; i++)
+    {
+        p[i] = value >> (i * 8);
+    }
+}
+
+static void write_wav_header(FILE *f, uint32_t nr_frames)
+{
+    uint8_t header[44];
+    uint32_t data_bytes = nr_frames * 4;
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, 36 + data_bytes, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);                         /* fmt chunk size */
+    put_le(header + 20, 1, 2);                          /* PCM */
+    put_le(header + 22, 2, 2);                          /* Stereo */
+    put_le(header + 24, AUDIO_RENDER_RATE, 4);
+    put_le(header + 28, AUDIO_RENDER_RATE * 4, 4);      /* Bytes per second */
+    put_le(header + 32, 4, 2);                          /* Bytes per frame */
+    put_le(header + 34, 16, 2);                         /* Bits per sample */
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, data_bytes, 4);
+    fwrite(header, 1, sizeof(header), f);
+}
+
+/* Event source for a square wave, as SOUND.COM would send it: the DAC toggles every half period */
+typedef struct
+{
+    uint16_t half_period_us;
+    uint8_t level;
+} tone_t;
+
+static bool pop_tone(int channel, uint32_t *delay_and_sample, void *ctx)
+{
+    tone_t *tone = ctx;
+    if (channel != 0)
+    {
+        return false;
+    }
+    tone->level = (uint8_t) -tone->level;
+    *delay_and_sample = (tone->half_period_us << 16) | (tone->level << 8);
+    return true;
+}
+
+static void render_frames(audio_renderer_t *renderer, int16_t *left, int nr_frames)
+{
+    int16_t block[BLOCK_FRAMES * 2];
+    for (int done = 0 ; done < nr_frames ; done += BLOCK_FRAMES)
+    {
+        audio_render_block(renderer, block, BLOCK_FRAMES);
+        if (left)
+        {
+            for (int i = 0 ; i < BLOCK_FRAMES && done + i < nr_frames ; i++)
+            {
+                left[done + i] = block[i * 2];
+            }
+        }
+    }
+}
+
+/* Energy of the frequency bin k of x, scaled so the energies of all bins add up to the energy of x */
+static double goertzel(const double *x, int n, int k)
+{
+    double coeff = 2 * cos(2 * M_PI * k / n);
+    double s1 = 0, s2 = 0;
+    for (int i = 0 ; i < n ; i++)
+    {
+        double s0 = x[i] + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s0;
+    }
+    return 2 * (s1 * s1 + s2 * s2 - coeff * s1 * s2) / n;
+}
+
+static int tone_test(int freq, const char *filename)
+{
+    tone_t tone = { .half_period_us = 500000 / freq, .level = TONE_LEVEL };
+    audio_renderer_t renderer;
+    static int16_t left[TONE_FRAMES];
+    static double x[TONE_FRAMES];
+
+    /* Speed */
+    audio_render_init(&renderer, pop_tone, &tone);
+    renderer.blep = !opt_naive;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    render_frames(&renderer, NULL, BENCH_SECONDS * AUDIO_RENDER_RATE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%s steps, %d Hz (%d us half period): %.2f ns per stereo sample\n", opt_naive ? "Naive" : "Band-limited",
+           freq, tone.half_period_us, ns / (BENCH_SECONDS * AUDIO_RENDER_RATE));
+
+    /* Aliasing. With a 1 second window every bin is 1Hz, so the harmonics of the actual tone fall exactly on bins */
+    audio_render_init(&renderer, pop_tone, &tone);
+    renderer.blep = !opt_naive;
+    render_frames(&renderer, NULL, TONE_SETTLE);
+    render_frames(&renderer, left, TONE_FRAMES);
+    double mean = 0, total = 0, harmonics = 0;
+    for (int i = 0 ; i < TONE_FRAMES ; i++)
+    {
+        mean += left[i];
+    }
+    mean /= TONE_FRAMES;
+    for (int i = 0 ; i < TONE_FRAMES ; i++)
+    {
+        x[i] = left[i] - mean;
+        total += x[i] * x[i];
+    }
+    int nr_harmonics = 0;
+    for (int h = 1 ; h * freq < AUDIO_RENDER_RATE / 2 ; h += 2)
+    {
+        harmonics += goertzel(x, TONE_FRAMES, h * freq);
+        nr_harmonics++;
+    }
+    double aliased = total - harmonics;
+    printf("%d odd harmonics below Nyquist, aliased energy %.1f dB relative to the tone\n",
+           nr_harmonics, 10 * log10((aliased > 0 ? aliased : 1e-12) / total));
+
+    if (filename)
+    {
+        FILE *out = fopen(filename, "wb");
+        if (!out)
+        {
+            perror(filename);
+            return 1;
+        }
+        write_wav_header(out, TONE_FRAMES);
+        for (int i = 0 ; i < TONE_FRAMES ; i++)
+        {
+            uint8_t bytes[4];
+            put_le(bytes, (uint16_t) left[i], 2);
+            put_le(bytes + 2, 0, 2);
+            fwrite(bytes, 1, sizeof(bytes), out);
+        }
+        fclose(out);
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n] events.txt output.wav\n", name);
+    fprintf(stderr, "       %s [-n] -c capture.bin output.wav\n", name);
+    fprintf(stderr, "       %s [-n] -t freq [output.wav]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int freq = 0;
+    bool capture = false;
+    int arg;
+    for (arg = 1 ; arg < argc && argv[arg][0] == '-' ; arg++)
+    {
+        if (strcmp(argv[arg], "-n") == 0)
+        {
+            opt_naive = true;
+        }
+        else if (strcmp(argv[arg], "-c") == 0)
+        {
+            capture = true;
+        }
+        else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+        {
+            freq = atoi(argv[++arg]);
+            /* The period has to be a whole number of us so the tone is exactly freq, and its harmonics fall on bins */
+            if (freq < 8 || freq > 20000 || 500000 % freq != 0)
+            {
+                fprintf(stderr, "Tone frequency must be 8 to 20000 Hz and divide 500000 (e.g. 625, 1250, 2500)\n");
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (freq)
+    {
+        if (argc - arg > 1)
+        {
+            usage(argv[0]);
+        }
+        return tone_test(freq, (arg < argc) ? argv[arg] : NULL);
+    }
+    if (argc - arg != 2)
+    {
+        usage(argv[0]);
+    }
+    if (!(capture ? read_capture(argv[arg]) : read_events(argv[arg])))
+    {
+        return 1;
+    }
+
+    /* Render until both channels have played all their events. Output is kept in memory so only the
+     * renderer is timed */
+    audio_renderer_t renderer;
+    audio_render_init(&renderer, pop_event, event_lists);
+    renderer.blep = !opt_naive;
+    int16_t *frames = NULL;
+    uint32_t nr_frames = 0;
+    uint32_t size = 0;
+    double render_ns = 0;
+    do
+    {
+        /* Room for up to RENDER_CHUNK blocks, which are timed together */
+        if (nr_frames + RENDER_CHUNK * BLOCK_FRAMES > size)
+        {
+            size = size ? size * 2 : RENDER_CHUNK * BLOCK_FRAMES * 16;
+            frames = realloc(frames, size * 2 * sizeof(int16_t));
+            if (!frames)
+            {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0 ; i < RENDER_CHUNK ; i++)
+        {
+            audio_render_block(&renderer, frames + nr_frames * 2, BLOCK_FRAMES);
+            nr_frames += BLOCK_FRAMES;
+            if (audio_render_idle(&renderer))
+            {
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        render_ns += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    } while (!audio_render_idle(&renderer));
+
+    FILE *out = fopen(argv[arg + 1], "wb");
+    if (!out)
+    {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    write_wav_header(out, nr_frames);
+    uint8_t bytes[BLOCK_FRAMES * 4];
+    for (uint32_t i = 0 ; i < nr_frames * 2 ; i += BLOCK_FRAMES * 2)
+    {
+        for (int j = 0 ; j < BLOCK_FRAMES * 2 ; j++)
+        {
+            put_le(bytes + j * 2, (uint16_t) frames[i + j], 2);
+        }
+        fwrite(bytes, 1, sizeof(bytes), out);
+    }
+    fclose(out);
+    free(frames);
+
+    double seconds = (double) nr_frames / AUDIO_RENDER_RATE;
+    printf("%d + %d events, %u frames (%.3f s), rendered in %.3f ms, %.0fx realtime\n",
+           event_lists[0].count, event_lists[1].count, nr_frames, seconds,
+           render_ns / 1e6, render_ns > 0 ? seconds * 1e9 / render_ns : 0);
+    return 0;
+}
@@ -32,26 +32,57 @@
 #include "bsp/board.h"
 #include "tusb.h"
 #include <string.h>
+#include <stdlib.h>
 #include "usb_joystick.h"
+#include "hid_devices.h"
+#include "joy_profile.h"
 
 
 #define DEBUG_INFO  DEBUG_JOYSTICK
 #define DEBUG_TRACE TRACE_JOYSTICK
 #include "debug.h"
 
+/* Full deflection of an axis, when building the axis tables */
+#define JOY_AXIS_ONE  32767
+
+/* X/Y values are the sum of the axis, hat switch and D-pad, clamped to -127 - 127 by joy_saturate */
+#define JOY_SAT_OFFSET (3 * 128)
+
+/* Controls read from a report, in report_controls */
+#define JOY_ROUTE_X         (1 << JOY_CONTROL_X)
+#define JOY_ROUTE_Y         (1 << JOY_CONTROL_Y)
+#define JOY_ROUTE_HAT       (1 << JOY_CONTROL_HAT)
+#define JOY_ROUTE_DPAD      (1 << JOY_CONTROL_DPAD)
+#define JOY_ROUTE_BUTTON1   0x10    /* Buttons 1 - 4 in bits 4 - 7 */
+
 /* Commands sent to Altair-duino */
 #define DAZ_JOY1      0x10
 #define DAZ_JOY2      0x20
 #define DAZ_KEY       0x30
 
-/* Support 2 joysticks */
-static usb_joystick joysticks[2];
+/*
+ * Every gamepad attached has a pad, and any two of them can be bound to Dazzler joysticks 1 and 2.
+ * Reports are dispatched to their pad through pad_lookup, indexed by device address and HID instance.
+ */
+#define JOY_MAX_DEV_ADDR    (CFG_TUH_DEVICE_MAX + CFG_TUH_HUB)
+
+static usb_joystick pads[CFG_TUH_HID];
+static int8_t pad_lookup[JOY_MAX_DEV_ADDR + 1][CFG_TUH_HID];   /* Pad number + 1, 0 if none */
+static int8_t bound_pad[JOY_NR_JOYSTICKS] = { -1, -1 };         /* Pad bound to each joystick, -1 if none */
+
+/* Clamp the sum of the X/Y inputs, indexed by sum + JOY_SAT_OFFSET */
+static int8_t joy_saturate[2 * JOY_SAT_OFFSET];
+
+/* X/Y for the 8 hat switch positions, clockwise from up */
+static const int8_t hat_directions[8][2] = {
+    { 0, 127 }, { 127, 127 }, { 127, 0 }, { 127, -127 }, { 0, -127 }, { -127, -127 }, { -127, 0 }, { -127, 127 }
+};
 
 /* Global used when calling hid_set_report so can block until result is received */
 static uint16_t hid_report_status = -1;
 
 void usb_send_bytes(uint8_t *buf, int count);
-static void joy_process_input(int joynum, usb_joystick* joy);
+static void joy_process_input(int joynum, const usb_joystick* joy);
 
 /* Return true if PS3 controller is connected. This controller needs 
  * additional USB commands to enable it */
@@ -93,6 +124,311 @@ bool is_xbox_controller(uint16_t pid)
     return (pid == 0x02e3);
 }
 
+/*
+ * Build the table mapping the native range of an axis to the signed 8 bit Dazzler value.
+ * Raw values are scaled to +/- JOY_AXIS_ONE either side of the calibrated centre, then the
+ * dead zone is removed and the response curve applied. The output is -127 to 127, as a
+ * value of -128 reverses direction in some games.
+ */
+static void joy_build_axis(joy_axis_t *axis, const hid_axis_t *hid, uint8_t dead_zone, uint8_t curve, bool invert)
+{
+    int64_t range = (int64_t) hid->logical_max - hid->logical_min;
+    int64_t dz = (int64_t) dead_zone * JOY_AXIS_ONE / 127;
+
+    /* Each table entry covers 1 << shift raw values */
+    axis->base = hid->logical_min;
+    axis->shift = 0;
+    while ((range >> axis->shift) > 255)
+        axis->shift++;
+
+    for (int i = 0 ; i < 256 ; i++)
+    {
+        /* Use the raw value in the entry furthest from the centre, so the end entries give full deflection */
+        int64_t raw = (int64_t) axis->base + ((int64_t) i << axis->shift);
+        if (raw >= axis->center)
+            raw += (1 << axis->shift) - 1;
+        int64_t v = 0;
+        if (raw >= axis->center && axis->max > axis->center)
+            v = (raw - axis->center) * JOY_AXIS_ONE / (axis->max - axis->center);
+        else if (raw < axis->center && axis->center > axis->min)
+            v = -((axis->center - raw) * JOY_AXIS_ONE / (axis->center - axis->min));
+
+        int64_t mag = (v < 0) ? -v : v;
+        if (mag > JOY_AXIS_ONE)
+            mag = JOY_AXIS_ONE;
+
+        /* Dead zone, then rescale so the output rises from 0 at the edge of the dead zone */
+        if (mag <= dz || dz >= JOY_AXIS_ONE)
+            mag = 0;
+        else
+            mag = (mag - dz) * JOY_AXIS_ONE / (JOY_AXIS_ONE - dz);
+
+        /* Blend between linear and cubic response */
+        int64_t cubic = mag * mag / JOY_AXIS_ONE * mag / JOY_AXIS_ONE;
+        mag = (mag * (256 - curve) + cubic * curve) >> 8;
+
+        int out = (mag * 127 + JOY_AXIS_ONE / 2) / JOY_AXIS_ONE;
+        axis->table[i] = ((v < 0) != invert) ? -out : out;
+    }
+}
+
+/* Set the default calibration from the HID logical ranges */
+static void joy_default_calibration(usb_joystick *joy)
+{
+    hid_axis_t *hid[2] = { &joy->def.x, &joy->def.y };
+    joy_axis_t *axis[2] = { &joy->axis_x, &joy->axis_y };
+
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        if (joy->zero_centered && hid[i]->bits > 1)
+        {
+            /* The XBOX descriptor gives a range of 0 - 65535, but the values are signed */
+            int64_t half = (int64_t) 1 << (hid[i]->bits - 1);
+            hid[i]->field.sign_shift = 32 - hid[i]->bits;
+            hid[i]->logical_min = -half;
+            hid[i]->logical_max = half - 1;
+        }
+        axis[i]->min = hid[i]->logical_min;
+        axis[i]->max = hid[i]->logical_max;
+        axis[i]->center = ((int64_t) hid[i]->logical_min + hid[i]->logical_max + 1) / 2;
+    }
+}
+
+/* Build the axis tables from the calibration */
+static void joy_init_axes(usb_joystick *joy)
+{
+    /* Dazzler Y is positive for up, HID Y is positive for down except on the XBOX */
+    joy_build_axis(&joy->axis_x, &joy->def.x, joy->dead_zone, joy->curve, false);
+    joy_build_axis(&joy->axis_y, &joy->def.y, joy->dead_zone, joy->curve, !joy->zero_centered);
+}
+
+/* Build the tables giving the X/Y values for the hat switch and D-pad. They are all 0 if not merged */
+static void joy_init_directions(usb_joystick *joy)
+{
+    const hid_axis_t *hat = &joy->def.hat;
+
+    /* The saturation table is shared by all joysticks, and is the same each time */
+    for (int i = 0 ; i < 2 * JOY_SAT_OFFSET ; i++)
+        joy_saturate[i] = MAX(-127, MIN(127, i - JOY_SAT_OFFSET));
+
+    memset(joy->hat_table, 0, sizeof(joy->hat_table));
+    memset(joy->dpad_table, 0, sizeof(joy->dpad_table));
+    if (!joy->merge_dpad)
+        return;
+
+    /* Hat switches have 4 or 8 positions, clockwise from up. Values past the last position are centred */
+    int64_t positions = hat->bits ? (int64_t) hat->logical_max - hat->logical_min + 1 : 0;
+    if (positions == 4 || positions == 8)
+    {
+        for (int i = 0 ; i < positions ; i++)
+        {
+            joy->hat_table[i][0] = hat_directions[i * 8 / positions][0];
+            joy->hat_table[i][1] = hat_directions[i * 8 / positions][1];
+        }
+    }
+
+    /* D-pad bits are up, down, right, left. Opposite directions cancel */
+    for (int i = 0 ; i < 16 ; i++)
+    {
+        joy->dpad_table[i][0] = ((i & 4) ? 127 : 0) - ((i & 8) ? 127 : 0);
+        joy->dpad_table[i][1] = ((i & 1) ? 127 : 0) - ((i & 2) ? 127 : 0);
+    }
+}
+
+/*
+ * Build the routing table from report id to the report of the joystick definition, and the controls
+ * read from each report. Reports without controls route to 0 and are ignored.
+ */
+static void joy_init_routes(usb_joystick *joy)
+{
+    const struct joystick_definition *def = &joy->def;
+
+    memset(joy->route, 0, sizeof(joy->route));
+    memset(joy->report_controls, 0, sizeof(joy->report_controls));
+    for (int r = 0 ; r < def->nr_reports && r < HID_MAX_JOY_REPORTS ; r++)
+        joy->route[def->report_id[r]] = r + 1;
+
+    if (def->x.bits)
+        joy->report_controls[def->control_report[JOY_CONTROL_X]] |= JOY_ROUTE_X;
+    if (def->y.bits)
+        joy->report_controls[def->control_report[JOY_CONTROL_Y]] |= JOY_ROUTE_Y;
+    if (def->hat.bits)
+        joy->report_controls[def->control_report[JOY_CONTROL_HAT]] |= JOY_ROUTE_HAT;
+    if (def->has_dpad)
+        joy->report_controls[def->control_report[JOY_CONTROL_DPAD]] |= JOY_ROUTE_DPAD;
+    for (int b = 0 ; b < 4 ; b++)
+    {
+        if (def->button[b].mask)
+            joy->report_controls[def->button_report[b]] |= JOY_ROUTE_BUTTON1 << b;
+    }
+}
+
+/* Apply changed settings: button map, calibration, dead zone, curve and D-pad merging */
+void joy_apply_settings(usb_joystick *joy)
+{
+    joystick_map_buttons(&joy->def, joy->button_map);
+    joy_init_routes(joy);
+    joy_init_axes(joy);
+    joy_init_directions(joy);
+}
+
+/* Return the pad bound to joystick joynum (from 0), or NULL if there is none */
+usb_joystick *joy_get(int joynum)
+{
+    if (joynum < 0 || joynum >= JOY_NR_JOYSTICKS || bound_pad[joynum] < 0)
+        return NULL;
+    return &pads[bound_pad[joynum]];
+}
+
+/* Return pad number pad, or NULL if it is not connected */
+usb_joystick *joy_get_pad(int pad)
+{
+    if (pad < 0 || pad >= CFG_TUH_HID || !pads[pad].connected)
+        return NULL;
+    return &pads[pad];
+}
+
+/* Return the pad for a HID interface, or NULL if it is not a pad */
+static inline usb_joystick *joy_find_pad(uint8_t dev_addr, uint8_t instance)
+{
+    if (dev_addr > JOY_MAX_DEV_ADDR || instance >= CFG_TUH_HID || pad_lookup[dev_addr][instance] == 0)
+        return NULL;
+    return &pads[pad_lookup[dev_addr][instance] - 1];
+}
+
+/* Send the state of a joystick, or released and centred if no pad is bound to it */
+static void joy_send_state(int joynum)
+{
+    static const usb_joystick released;
+    int pad = bound_pad[joynum];
+
+    if (pad >= 0)
+        pads[pad].pending = false;
+    joy_process_input(joynum, (pad >= 0) ? &pads[pad] : &released);
+}
+
+/*
+ * Bind pads to joysticks 1 and 2 (-1 for none). The state of each joystick that changes pad is sent
+ * straight away, so the Altair never keeps buttons held on a pad that has gone.
+ */
+static void joy_set_bindings(int pad1, int pad2)
+{
+    int new_pads[JOY_NR_JOYSTICKS] = { pad1, pad2 };
+
+    for (int j = 0 ; j < JOY_NR_JOYSTICKS ; j++)
+    {
+        if (bound_pad[j] >= 0)
+            pads[bound_pad[j]].joynum = -1;
+    }
+    for (int j = 0 ; j < JOY_NR_JOYSTICKS ; j++)
+    {
+        bool changed = bound_pad[j] != new_pads[j];
+        bound_pad[j] = new_pads[j];
+        if (bound_pad[j] >= 0)
+            pads[bound_pad[j]].joynum = j;
+        if (changed)
+        {
+            if (bound_pad[j] >= 0)
+                printf("Joystick %d is pad %d\n", j + 1, bound_pad[j] + 1);
+            else
+                printf("Joystick %d has no pad\n", j + 1);
+            joy_send_state(j);
+        }
+    }
+}
+
+/* Bind a pad to a joystick. If it is bound to the other joystick, the two are swapped */
+bool joy_bind(int joynum, int pad)
+{
+    if (joynum < 0 || joynum >= JOY_NR_JOYSTICKS || (pad >= 0 && joy_get_pad(pad) == NULL))
+        return false;
+
+    int new_pads[JOY_NR_JOYSTICKS] = { bound_pad[0], bound_pad[1] };
+    if (pad >= 0 && new_pads[!joynum] == pad)
+        new_pads[!joynum] = new_pads[joynum];
+    new_pads[joynum] = pad;
+    joy_set_bindings(new_pads[0], new_pads[1]);
+    return true;
+}
+
+/* Return the first connected pad not bound to a joystick, or -1 */
+static int joy_unbound_pad(void)
+{
+    for (int pad = 0 ; pad < CFG_TUH_HID ; pad++)
+    {
+        if (pads[pad].connected && pads[pad].joynum < 0)
+            return pad;
+    }
+    return -1;
+}
+
+/* Save the definition and settings of a joystick as the profile for its controller */
+bool joy_save_profile(usb_joystick *joy)
+{
+    static joy_profile_t profile;
+    const joy_axis_t *axis[2] = { &joy->axis_x, &joy->axis_y };
+
+    memset(&profile, 0, sizeof(profile));
+    profile.vid = joy->vid;
+    profile.pid = joy->pid;
+    profile.desc_hash = joy->desc_hash;
+    memcpy(profile.button_map, joy->button_map, sizeof(profile.button_map));
+    profile.dead_zone = joy->dead_zone;
+    profile.curve = joy->curve;
+    profile.merge_dpad = joy->merge_dpad;
+    profile.zero_centered = joy->zero_centered;
+    profile.hysteresis = joy->hysteresis;
+    profile.frame_sync = joy->frame_sync;
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        profile.calibration[i][0] = axis[i]->min;
+        profile.calibration[i][1] = axis[i]->center;
+        profile.calibration[i][2] = axis[i]->max;
+    }
+    profile.def = joy->def;
+    joy->save_pending = false;
+    return joy_profile_store(&profile);
+}
+
+/*
+ * Write a profile for a controller that was mounted without one. Writing flash stalls video and audio,
+ * so this is called from the main loop only while the Dazzler is off and no audio is playing.
+ * One profile is written per call to keep each stall short.
+ */
+void joy_save_new_profiles(void)
+{
+    for (int i = 0 ; i < CFG_TUH_HID ; i++)
+    {
+        if (pads[i].connected && pads[i].save_pending)
+        {
+            printf("Saving profile for pad %d\n", i + 1);
+            joy_save_profile(&pads[i]);
+            return;
+        }
+    }
+}
+
+/* Set up a joystick from the profile for its controller */
+static void joy_load_profile(usb_joystick *joy, const joy_profile_t *profile)
+{
+    joy_axis_t *axis[2] = { &joy->axis_x, &joy->axis_y };
+
+    memcpy(joy->button_map, profile->button_map, sizeof(joy->button_map));
+    joy->dead_zone = profile->dead_zone;
+    joy->curve = profile->curve;
+    joy->merge_dpad = profile->merge_dpad;
+    joy->zero_centered = profile->zero_centered;
+    joy->hysteresis = profile->hysteresis;
+    joy->frame_sync = profile->frame_sync;
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        axis[i]->min = profile->calibration[i][0];
+        axis[i]->center = profile->calibration[i][1];
+        axis[i]->max = profile->calibration[i][2];
+    }
+    joy->def = profile->def;
+}
+
 /* Callback when Invoked when device with hid interface type of "None" is mounted
  * Check if this is a joystick or gamepad and initialize it */
 void joy_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
@@ -110,19 +446,37 @@ void joy_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
         !memcmp(desc_report, gamepad_hid, sizeof (gamepad_hid)))
     {
         printf("JOYSTICK or GAMEPAD connected\r\n");
-        for (int i = 0 ; i < 2 ; i++)
+        for (int i = 0 ; i < CFG_TUH_HID ; i++)
         {
-            if (!joysticks[i].connected)
+            if (!pads[i].connected)
             {
-                memset(&joysticks[i], 0, sizeof(usb_joystick));
+                memset(&pads[i], 0, sizeof(usb_joystick));
+
+                pads[i].joynum = -1;
+                pads[i].dev_addr = dev_addr;
+                pads[i].instance = instance;
+                pads[i].vid = vid;
+                pads[i].pid = pid;
+                pads[i].desc_hash = joy_profile_hash(desc_report, desc_len);
+                pads[i].dead_zone = 8;
+                pads[i].merge_dpad = true;
+                pads[i].hysteresis = 1;
+                pads[i].in_hat = 0x0f;      /* Centred until the report with the hat switch is received */
+                joystick_default_buttons(pid, pads[i].button_map);
 
-                joysticks[i].dev_addr = dev_addr;
-                joysticks[i].instance = instance;
-                joysticks[i].dead_zone = 8;
-                if (parse_report_descriptor(pid, desc_report, desc_len, &joysticks[i].offsets))
+                /* A controller seen before is set up from its profile, without parsing the descriptor */
+                const joy_profile_t *profile = joy_profile_find(vid, pid, pads[i].desc_hash);
+                if (profile != NULL)
                 {
-                    joysticks[i].connected = true;
-                    printf("Connected as joystick %d\n", i);
+                    printf("Using stored profile\n");
+                    joy_load_profile(&pads[i], profile);
+                }
+                if (profile != NULL || parse_report_descriptor(pid, desc_report, desc_len, &pads[i].def))
+                {
+                    pads[i].connected = true;
+                    printf("Connected as pad %d\n", i + 1);
+                    /* Reports are requested again as each one is received */
+                    hid_request_report(dev_addr, instance);
                     if (is_ps3_controller(pid))
                     {
                         /* PS3 controller needs a command to tell it to start sending reports */
@@ -160,11 +514,30 @@ void joy_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
                         xfer.daddr = dev_addr;
                   
                         tuh_edpt_xfer(&xfer);
-                        joysticks[i].zero_centered = true;
-                        /* My XBOX elite controller seems to have really bad centering */
-                        joysticks[i].dead_zone = 16;
+                        if (profile == NULL)
+                        {
+                            pads[i].zero_centered = true;
+                            /* My XBOX elite controller seems to have really bad centering */
+                            pads[i].dead_zone = 16;
+                        }
                         printf("SENT XBOX REPORT\n");
                     }
+                    /* Writing flash here would stall video and audio on every hot-plug, so the
+                     * profile is written later by joy_save_new_profiles, when nothing is playing */
+                    if (profile == NULL)
+                    {
+                        joy_default_calibration(&pads[i]);
+                        pads[i].save_pending = true;
+                    }
+                    joy_apply_settings(&pads[i]);
+
+                    /* The pad takes the first joystick that is free */
+                    if (dev_addr <= JOY_MAX_DEV_ADDR && instance < CFG_TUH_HID)
+                        pad_lookup[dev_addr][instance] = i + 1;
+                    if (bound_pad[0] < 0)
+                        joy_set_bindings(i, bound_pad[1]);
+                    else if (bound_pad[1] < 0)
+                        joy_set_bindings(bound_pad[0], i);
                 }
                 else
                 {
@@ -179,112 +552,152 @@ void joy_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 /* Invoked when device with hid interface is un-mounted */
 void joy_hid_unmount_cb(uint8_t dev_addr, uint8_t instance)
 {
-  for (int i = 0 ; i < 2 ; i++)
-  {
-    if (joysticks[i].dev_addr == dev_addr && joysticks[i].instance == instance)
+    usb_joystick *joy = joy_find_pad(dev_addr, instance);
+    if (joy == NULL)
+        return;
+
+    int pad = pad_lookup[dev_addr][instance] - 1;
+    printf("Disconnecting pad %d\n", pad + 1);
+    pad_lookup[dev_addr][instance] = 0;
+    joy->connected = false;
+
+    /* Another pad that is not in use takes over its joystick */
+    if (joy->joynum >= 0)
     {
-      printf("Disconnecting joystick %d\n", i);
-      joysticks[i].connected = false;
-      break;
+        int new_pads[JOY_NR_JOYSTICKS] = { bound_pad[0], bound_pad[1] };
+        new_pads[joy->joynum] = joy_unbound_pad();
+        joy_set_bindings(new_pads[0], new_pads[1]);
     }
-  }
 }
 
 
-/* Invoked when received report from device via interrupt endpoint */
-void joy_process_hid_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+/* Return the Dazzler value for an axis in a report, with a single table lookup.
+ * Values outside the logical range read the entry at that end of the table */
+static inline uint8_t joy_axis_value(const joy_axis_t *axis, const hid_axis_t *hid, const uint8_t *report)
+{
+    return axis->table[hid_table_index(hid_extract(&hid->field, report), axis->base, axis->shift)];
+}
+
+/* True if an axis has moved by more than the hysteresis, or on to the centre or a limit */
+static inline bool joy_axis_moved(uint8_t prev, uint8_t value, uint8_t hysteresis)
+{
+    int diff = (int8_t) value - (int8_t) prev;
+    return value != prev &&
+           (abs(diff) > hysteresis || value == 0 || (int8_t) value == 127 || (int8_t) value == -127);
+}
+
+/*
+ * Holding all 4 buttons for 2 seconds swaps joysticks 1 and 2, or takes over joystick 1 if the pad
+ * is not bound to a joystick. So a single controller can be used with software like AMBUSH.COM which
+ * requires the second joystick to play.
+ */
+static void joy_swap_gesture(int pad, const usb_joystick *joy)
 {
-    PRINT_TRACE("process_joystick_report\n");
     static absolute_time_t swap_time;
-    static int swapping_joy = -1;   /* Joystick no that is initiating swap */
+    static int swapping_pad = -1;   /* Pad that is initiating swap */
     static bool swapped = false;    /* True if swapped, but buttons not yet released */
-    for (int i = 0 ; i < 2 ; i++)
+
+    if (joy->buttons == 0x0f)
     {
-        usb_joystick* joy = &joysticks[i];
-        /* check if joystick is connected and values have changed since last report */
-        if(joy->dev_addr == dev_addr &&
-           joy->instance == instance &&
-           joy->connected)
+        absolute_time_t now = get_absolute_time();
+        if (swapping_pad == -1 && !swapped)  /* Swap not initiated and not finishing a swap */
         {
-            /* If there are multiple report types, the reportid is assumed to be the first byte */
-            if ((!joy->offsets.has_report_id || joy->offsets.report_id == report[0]) &&
-                (joy->prev_x != report[joy->offsets.x_axis_byte] ||
-                joy->prev_y != report[joy->offsets.y_axis_byte] ||
-                joy->prev_buttons != report[joy->offsets.buttons_byte]))
-            {
-                joy->x = report[joy->offsets.x_axis_byte];
-                joy->y = report[joy->offsets.y_axis_byte];
-                uint8_t buttons = report[joy->offsets.buttons_byte];
-                joy->buttons = buttons;
-                joy->b1 = buttons & joy->offsets.b1_mask;
-                joy->b2 = buttons & joy->offsets.b2_mask;
-                joy->b3 = buttons & joy->offsets.b3_mask;
-                joy->b4 = buttons & joy->offsets.b4_mask;
-            
-                joy_process_input(i, &joysticks[i]);
-                joysticks[i].prev_x = report[joysticks[i].offsets.x_axis_byte];
-                joysticks[i].prev_y = report[joysticks[i].offsets.y_axis_byte];
-                joysticks[i].prev_buttons = report[joysticks[i].offsets.buttons_byte];
-            }
-            /*
-            * Can swap Joysticks by holding all 4 buttons for 2 seconds
-            */
-            if (joy->b1 && joy->b2 && joy->b3 && joy->b4)
-            {
-                absolute_time_t now = get_absolute_time();
-                if (swapping_joy == -1 && !swapped)  /* Swap not initiated and not finishing a swap */
-                {
-                    swapping_joy = i;
-                    swap_time = delayed_by_ms(now, 2000);
-                }
-                else if (swapping_joy == i && !swapped) /* Swap already initiated on this joystick */
-                {
-                    if (absolute_time_diff_us(swap_time, now) >= 0)
-                    {
-                        printf("SWAPPING JOYSTICKS\n");
-                        usb_joystick swapped_joy[2];
-                        memcpy(&swapped_joy[0], &joysticks[1], sizeof(usb_joystick));
-                        memcpy(&swapped_joy[1], &joysticks[0], sizeof(usb_joystick));
-                        memcpy(joysticks, swapped_joy, sizeof(swapped_joy));
-                        swapped = true;
-                        /* Clear button presses on other joystick */
-                        if (!joysticks[swapping_joy].connected)
-                        {
-                            memset(&joysticks[swapping_joy], 0, sizeof(usb_joystick));
-                        }
-                        joy_process_input(swapping_joy, &joysticks[swapping_joy]);
-                        swapping_joy = (swapping_joy == 0) ? 1 : 0;
-                        /* Send update for initiating joystick */
-                        joy_process_input(swapping_joy, &joysticks[swapping_joy]);
-                    }
-                }
-            }
-            else if (swapping_joy == i) /* Buttons released on swapping joystick */
-            {
-                swapping_joy = -1;
-                swapped = false;
-            }
-            /* Report is for a single joystick. Don't keep looking */
-            break;         
+            swapping_pad = pad;
+            swap_time = delayed_by_ms(now, 2000);
+        }
+        else if (swapping_pad == pad && !swapped && absolute_time_diff_us(swap_time, now) >= 0)
+        {
+            printf("SWAPPING JOYSTICKS\n");
+            if (joy->joynum >= 0)
+                joy_set_bindings(bound_pad[1], bound_pad[0]);
+            else
+                joy_set_bindings(pad, bound_pad[1]);
+            swapped = true;
         }
     }
+    else if (swapping_pad == pad) /* Buttons released on swapping pad */
+    {
+        swapping_pad = -1;
+        swapped = false;
+    }
 }
 
-/*
- * Request to receive a HID report from the joystick. 
- */
-void joy_schedule_hid_input(void)
+/* Invoked when received report from device via interrupt endpoint */
+void joy_process_hid_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
-    for (int i = 0 ; i < 2 ; i++)
+    PRINT_TRACE("process_joystick_report\n");
+    usb_joystick *joy = joy_find_pad(dev_addr, instance);
+    if (joy == NULL || !joy->connected)
+        return;
+
+    /* 
+     * If there are multiple report types, the report id is the first byte and routes the report to
+     * the controls it holds. Controls in other reports keep their last value
+     */
+    const struct joystick_definition *def = &joy->def;
+    uint8_t route = def->has_report_id ? joy->route[report[0]] : 1;
+    if (route == 0 || len < def->report_len[route - 1])
+        return;
+    uint8_t controls = joy->report_controls[route - 1];
+
+    if (controls & JOY_ROUTE_X)
+        joy->in_x = joy_axis_value(&joy->axis_x, &def->x, report);
+    if (controls & JOY_ROUTE_Y)
+        joy->in_y = joy_axis_value(&joy->axis_y, &def->y, report);
+    if (controls & JOY_ROUTE_HAT)
+        joy->in_hat = (uint32_t) (hid_extract(&def->hat.field, report) - def->hat.logical_min) & 0x0f;
+    if (controls & JOY_ROUTE_DPAD)
+    {
+        joy->in_dpad = (hid_extract(&def->dpad[0], report) != 0) |
+                       (hid_extract(&def->dpad[1], report) != 0) << 1 |
+                       (hid_extract(&def->dpad[2], report) != 0) << 2 |
+                       (hid_extract(&def->dpad[3], report) != 0) << 3;
+    }
+    for (int b = 0 ; b < 4 ; b++)
+    {
+        if (controls & (JOY_ROUTE_BUTTON1 << b))
+            joy->in_buttons = (joy->in_buttons & ~(1 << b)) | hid_extract(&def->button[b], report) << b;
+    }
+
+    uint8_t x = joy_saturate[JOY_SAT_OFFSET + joy->in_x + joy->hat_table[joy->in_hat][0] + joy->dpad_table[joy->in_dpad][0]];
+    uint8_t y = joy_saturate[JOY_SAT_OFFSET + joy->in_y + joy->hat_table[joy->in_hat][1] + joy->dpad_table[joy->in_dpad][1]];
+    uint8_t buttons = joy->in_buttons;
+
+    /* Changes are found on the output values, so noise inside the dead zone is never sent */
+    if (joy->prev_buttons != buttons ||
+        joy_axis_moved(joy->prev_x, x, joy->hysteresis) ||
+        joy_axis_moved(joy->prev_y, y, joy->hysteresis))
     {
-        if (joysticks[i].connected)
+        hid_stats_changed();
+        joy->x = x;
+        joy->y = y;
+        joy->buttons = buttons;
+        joy->b1 = buttons & 0x01;
+        joy->b2 = buttons & 0x02;
+        joy->b3 = buttons & 0x04;
+        joy->b4 = buttons & 0x08;
+
+        /* Pads not bound to a joystick keep their state, which is sent when they are bound */
+        if (joy->joynum >= 0)
         {
-            bool result = tuh_hid_receive_report(joysticks[i].dev_addr, joysticks[i].instance);
-            PRINT_TRACE("tuh_hid_receive_report(%d, %d) = %d\n", joysticks[i].dev_addr, joysticks[i].instance, result);
+            /* Button presses are sent straight away, X/Y may wait for the VSYNC */
+            if (joy->prev_buttons != buttons || !joy->frame_sync)
+            {
+                joy_process_input(joy->joynum, joy);
+                joy->pending = false;
+            }
+            else
+            {
+                joy->pending = true;
+            }
         }
+        joy->prev_x = x;
+        joy->prev_y = y;
+        joy->prev_buttons = buttons;
     }
+    joy_swap_gesture(pad_lookup[dev_addr][instance] - 1, joy);
 }
-  
+
 /*
  * HID Set reports are async. setting status to not be -1 indicates that status send is complete.
  * A non-zero value in hid_report_status indicates success.
@@ -296,41 +709,20 @@ void tuh_hid_set_report_complete_cb(uint8_t dev_addr, uint8_t instance, uint8_t
 }
 
 
-static uint8_t joy_get_value_x (usb_joystick* joy)
+/* Send the joystick changes held back until the VSYNC, so the Altair gets at most one per frame */
+void joy_vsync(void)
 {
-    int16_t sval = joy->zero_centered ? (int8_t) joy->x : joy->x;
-    if (!joy->zero_centered)
+    for (int j = 0 ; j < JOY_NR_JOYSTICKS ; j++)
     {
-        sval -= 127;
-        // Actually need to -128 for the +ve direction
-        if (sval == 128) sval -= 1;
-    }
-    if (sval > -joy->dead_zone && sval < joy->dead_zone)
-        sval = 0;
-    /* Value of -128 reverses direction in some games */
-    if (sval == -128) sval += 1;
-
-    return (uint8_t) sval;
-}
-
-static uint8_t joy_get_value_y (usb_joystick* joy)
-{
-    int16_t sval = joy->zero_centered ? (int8_t) joy->y : joy->y;
-    if (!joy->zero_centered)
-    {
-        sval -= 127;
-        sval = -sval;
+        if (bound_pad[j] >= 0 && pads[bound_pad[j]].pending)
+        {
+            joy_send_state(j);
+        }
     }
-     /* Value of -128 reverses direction in some games */   
-    if (sval == -128) sval += 1;
-    if (sval > -joy->dead_zone && sval < joy->dead_zone)
-        sval = 0;
-
-    return (uint8_t) sval;
 }
 
 /* Send joystick input to Altair-duino */
-static void joy_process_input(int joynum, usb_joystick* joy)
+static void joy_process_input(int joynum, const usb_joystick* joy)
 {
     uint8_t daz_msg[3];
     daz_msg[0] = (joynum == 0) ? DAZ_JOY1 : DAZ_JOY2;
@@ -339,8 +731,8 @@ static void joy_process_input(int joynum, usb_joystick* joy)
     if (!joy->b3) daz_msg[0] |= 4;
     if (!joy->b4) daz_msg[0] |= 8;
 
-    daz_msg[1] = joy_get_value_x(joy);
-    daz_msg[2] = joy_get_value_y(joy);
+    daz_msg[1] = joy->x;
+    daz_msg[2] = joy->y;
 
     PRINT_INFO("Joy = %d, X = %d, Y = %d, btn = %x, msg[0] = %02x\r\n", joynum, (int8_t) daz_msg[1], (int8_t) daz_msg[2], daz_msg[0] & 0x0F, daz_msg[0]);
     usb_send_bytes(daz_msg, 3);
@@ -29,27 +29,64 @@
 #include <stdint.h>
 #include "parse_descriptor.h"
 
+/*
+ * Mapping of one axis from its native HID range to the signed 8 bit Dazzler value.
+ * The HID logical range is divided into 256 table entries, each covering 1 << shift raw values,
+ * and the table holds the output with calibration, dead zone and response curve applied.
+ */
+typedef struct
+{
+    int32_t min;                        /* Calibration: raw value at full deflection left / up */
+    int32_t center;                     /* Calibration: raw value when centred */
+    int32_t max;                        /* Calibration: raw value at full deflection right / down */
+    int32_t base;                       /* Raw value of table[0], the logical minimum */
+    uint8_t shift;
+    int8_t  table[256];
+} joy_axis_t;
+
 /*
  * The current joystick / controller state with current and previous values
  */
 typedef struct 
 {
     uint8_t connected;
+    int8_t  joynum;                     /* Dazzler joystick the pad is bound to (from 0), -1 if none */
     uint8_t dev_addr;
     uint8_t instance;
-    uint8_t x;
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t desc_hash;                 /* Hash of the HID report descriptor, to find the profile */
+    uint8_t button_map[4];              /* HID button (from 0) used for buttons 1 - 4 */
+    uint8_t x;                          /* Signed 8 bit Dazzler values, after the axis tables */
     uint8_t y;
-    uint8_t buttons;
+    uint8_t buttons;                    /* Buttons 1 - 4 in bits 0 - 3 */
     uint8_t b1;
     uint8_t b2;
     uint8_t b3;
     uint8_t b4;
-    uint8_t prev_x;
+    uint8_t prev_x;                     /* Last values accepted as a change, sent or pending */
     uint8_t prev_y;
     uint8_t prev_buttons;
+    uint8_t pending;                    /* X/Y changed, to be sent at the next VSYNC */
     uint8_t zero_centered;              /* True if centre value of joystick is 0 e.g. XBOX controller*/
     uint8_t dead_zone;                  /* controllers don't report 0 when "centered" can cause issues in some gsames */
-    struct  joystick_bytes offsets;
+    uint8_t curve;                      /* Response curve, 0 = linear to 255 = cubic */
+    uint8_t merge_dpad;                 /* Add the hat switch and D-pad to the X/Y values */
+    uint8_t hysteresis;                 /* X/Y changes of this much or less are not sent, except to the centre or limits */
+    uint8_t frame_sync;                 /* Send X/Y changes at most once per VSYNC, button changes are sent immediately */
+    uint8_t save_pending;               /* No profile was found when mounted, so one is written by joy_save_new_profiles */
+    joy_axis_t axis_x;
+    joy_axis_t axis_y;
+    int8_t  hat_table[16][2];           /* X/Y for each hat switch value - logical minimum */
+    int8_t  dpad_table[16][2];          /* X/Y for each combination of D-pad up, down, right, left */
+    uint8_t route[256];                 /* Report index + 1 for each report id, 0 for reports without controls */
+    uint8_t report_controls[HID_MAX_JOY_REPORTS];  /* JOY_ROUTE_ controls read from each report */
+    int8_t  in_x;                       /* Latest value of each control, from the last report that holds it */
+    int8_t  in_y;
+    uint8_t in_hat;                     /* Hat switch value - logical minimum */
+    uint8_t in_dpad;                    /* D-pad up, down, right, left in bits 0 - 3 */
+    uint8_t in_buttons;
+    struct  joystick_definition def;    /* Extractors for the controls in the HID reports */
 } usb_joystick;
 
 /* Tiny USB Callbacks */
@@ -57,9 +94,20 @@ void joy_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 void joy_hid_unmount_cb(uint8_t dev_addr, uint8_t instance);
 void joy_process_hid_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
 
-/* Poll usb for input */
-void joy_schedule_hid_input(void);
+/* Send the joystick changes held back until the VSYNC */
+void joy_vsync(void);
 
 bool is_xbox_controller(uint16_t pid);
 
+/* Pads, for each gamepad attached, and the two bound to Dazzler joysticks 1 and 2 */
+#define JOY_NR_JOYSTICKS    2
+usb_joystick *joy_get(int joynum);
+usb_joystick *joy_get_pad(int pad);
+bool joy_bind(int joynum, int pad);
+
+/* Profile support */
+void joy_apply_settings(usb_joystick *joy);
+bool joy_save_profile(usb_joystick *joy);
+void joy_save_new_profiles(void);
+
 #endif
\ No newline at end of file
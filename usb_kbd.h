@@ -23,10 +23,22 @@
  *
  */
 #ifndef __USB_KBD_H__
+#define __USB_KBD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
 
 void kbd_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len);
 void kbd_hid_unmount_cb(uint8_t dev_addr, uint8_t instance);
-void kbd_schedule_hid_input(void);
 void kbd_process_hid_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
 
+/* Send key repeats that are due. Called from the main loop */
+void kbd_task(void);
+
+/* Set the time a key is held before it repeats, and the time between repeats. A delay of 0 turns repeat off */
+void kbd_set_repeat(uint16_t delay_ms, uint16_t interval_ms);
+
+/* Select the keyboard layout by name (us, uk or de). Returns false if there is no such layout */
+bool kbd_set_layout(const char *name);
+
 #endif
\ No newline at end of file